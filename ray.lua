@@ -39,9 +39,70 @@ typedef enum {
   RAY_FS_SYMLINK,
   RAY_FS_READLINK,
   RAY_FS_CHOWN,
-  RAY_FS_FCHOWN
+  RAY_FS_FCHOWN,
+  RAY_FS_MMAP,
+  RAY_FS_MUNMAP,
+  RAY_FS_BATCH,
+  RAY_MESSAGE
 } ray_type_t;
 
+typedef enum {
+  RAY_BATCH_STAT,
+  RAY_BATCH_LSTAT,
+  RAY_BATCH_UNLINK,
+  RAY_BATCH_READ
+} ray_batch_op_t;
+
+typedef enum {
+  RAY_FS_ENGINE_THREADPOOL,
+  RAY_FS_ENGINE_URING
+} ray_fs_engine_t;
+
+typedef enum {
+  RAY_ADVISE_NORMAL,
+  RAY_ADVISE_SEQUENTIAL,
+  RAY_ADVISE_RANDOM,
+  RAY_ADVISE_WILLNEED,
+  RAY_ADVISE_DONTNEED
+} ray_advice_t;
+
+typedef enum {
+  RAY_WAIT_READ,
+  RAY_WAIT_WRITE,
+  RAY_WAIT_ACCEPT,
+  RAY_WAIT_CLOSE,
+  RAY_WAIT_CONNECT,
+  RAY_WAIT_MAX
+} ray_wait_op_t;
+
+typedef enum {
+  RAY_LANE_CONTROL,
+  RAY_LANE_IO,
+  RAY_LANE_FS,
+  RAY_LANE_MAX
+} ray_lane_id_t;
+
+typedef enum {
+  RAY_LANE_WRR,
+  RAY_LANE_STRICT
+} ray_lane_policy_t;
+
+typedef enum {
+  RAY_ACCEPT_AUTO = 1,
+  RAY_ACCEPT_READ = 2
+} ray_accept_flag_t;
+
+typedef enum {
+  RAY_MEM_HANDLE,
+  RAY_MEM_READ,
+  RAY_MEM_FS,
+  RAY_MEM_STRING,
+  RAY_MEM_BUFFER,
+  RAY_MEM_MAIL,
+  RAY_MEM_OTHER,
+  RAY_MEM_MAX
+} ray_mem_cat_t;
+
 typedef int ray_file_t;
 
 typedef struct ray_buf_s    ray_buf_t;
@@ -51,6 +112,15 @@ typedef struct ray_handle_s ray_handle_t;
 
 typedef struct ray_dir_s    ray_dir_t;
 typedef struct ray_stat_s   ray_stat_t;
+typedef struct ray_map_s    ray_map_t;
+typedef struct ray_fs_batch_s  ray_fs_batch_t;
+typedef struct ray_fs_result_s ray_fs_result_t;
+typedef struct ray_fs_chunk_s  ray_fs_chunk_t;
+typedef struct ray_iov_s    ray_iov_t;
+typedef struct ray_lease_s  ray_lease_t;
+typedef struct ray_pool_stats_s ray_pool_stats_t;
+typedef struct ray_mail_s   ray_mail_t;
+typedef uint64_t ray_addr_t;
 
 struct ray_buf_s {
   size_t   size;
@@ -58,9 +128,19 @@ struct ray_buf_s {
   uint8_t* base;
 };
 
+struct ray_mail_s {
+  ray_buf_t     buf;
+  size_t        len;
+  ray_addr_t    from;
+  uint32_t      to;
+  ray_mail_t*   next;
+  ray_queue_t*  queue;
+  size_t        charged;
+};
+
 struct ray_evt_s {
   ray_type_t    type;
-  ray_handle_t* self;
+  uint32_t      id;
   int           info;
   void*         data;
 };
@@ -70,6 +150,32 @@ struct ray_dir_s {
   size_t  nlen;
 };
 
+struct ray_map_s {
+  void*   base;
+  size_t  size;
+};
+
+struct ray_iov_s {
+  char*   base;
+  size_t  len;
+};
+
+struct ray_lease_s {
+  int      ticket;
+  int      status;
+  uint64_t wait_ns;
+};
+
+struct ray_pool_stats_s {
+  uint64_t acquires;
+  uint64_t reuses;
+  uint64_t connects;
+  uint64_t waits;
+  uint64_t evictions;
+  uint64_t wait_ns;
+  uint64_t max_wait_ns;
+};
+
 typedef struct ray_timespec_s {
   long tv_sec;
   long tv_nsec;
@@ -89,25 +195,81 @@ struct ray_stat_s {
   ray_timespec_t ctim;
 };
 
+struct ray_fs_result_s {
+  int         op;
+  int         status;
+  char*       path;
+  ray_stat_t  stat;
+  char*       data;
+  size_t      len;
+};
+
+struct ray_fs_batch_s {
+  ray_queue_t*     queue;
+  size_t           nops;
+  size_t           size;
+  ray_fs_result_t* ops;
+  size_t           max_read;
+  size_t           nchunks;
+  size_t           npending;
+  ray_fs_chunk_t*  chunks;
+};
+
 ray_buf_t* ray_buf_new(size_t size);
-void ray_buf_init(ray_buf_t* buf);
 void ray_buf_need(ray_buf_t* buf, size_t len);
-void ray_buf_write(ray_buf_t* buf, const char* str, size_t len);
-void ray_buf_clear(ray_buf_t* buf);
-const char* ray_buf_read(ray_buf_t* buf, size_t len);
+void ray_buf_init(ray_buf_t* buf, uint8_t* data, size_t len);
 void ray_buf_free(ray_buf_t* buf);
+void ray_buf_clear(ray_buf_t* buf);
+
+void ray_buf_put(ray_buf_t* buf, uint8_t val);
+void ray_buf_put_uint16(ray_buf_t* buf, uint16_t val);
+void ray_buf_put_uint32(ray_buf_t* buf, uint32_t val);
+void ray_buf_put_uint64(ray_buf_t* buf, uint64_t val);
+void ray_buf_put_double(ray_buf_t* buf, double val);
+void ray_buf_put_uleb128(ray_buf_t* buf, uint32_t val);
+
+uint8_t  ray_buf_get(ray_buf_t* buf);
+uint16_t ray_buf_get_uint16(ray_buf_t* buf);
+uint32_t ray_buf_get_uint32(ray_buf_t* buf);
+uint64_t ray_buf_get_uint64(ray_buf_t* buf);
+double   ray_buf_get_double(ray_buf_t* buf);
+uint32_t ray_buf_get_uleb128(ray_buf_t* buf);
+uint8_t  ray_buf_peek(ray_buf_t* buf);
+
+void ray_buf_write(ray_buf_t* buf, uint8_t* data, size_t len);
+uint8_t* ray_buf_read(ray_buf_t* buf, size_t len);
+
+size_t ray_buf_get_offset(ray_buf_t* buf);
+void   ray_buf_set_offset(ray_buf_t* buf, ssize_t ofs);
 
 ray_queue_t* ray_queue_new(size_t size);
 int ray_queue_init(ray_queue_t* self, size_t size);
 void ray_queue_free(ray_queue_t* self);
 
 int ray_evt_count(ray_queue_t* self);
+int ray_lane_of(int type);
+int ray_evt_lane(const ray_evt_t* evt);
+int ray_queue_set_lane_policy(ray_queue_t* self, int policy);
+int ray_queue_set_lane_weight(ray_queue_t* self, int lane, int weight);
 ray_evt_t ray_evt_init(ray_handle_t* o, ray_type_t t, int i, void* d);
 
-ray_handle_t* ray_handle_new(ray_queue_t* queue);
+ray_handle_t* ray_handle_new(ray_queue_t* queue, int type);
 void ray_handle_free(ray_handle_t* self);
+ray_handle_t* ray_handle_get(ray_queue_t* queue, uint32_t id);
+int ray_handle_reserve(ray_queue_t* queue, int type, size_t n);
+
+int ray_wait(ray_handle_t* self, int op, int fid);
+int ray_wait_pop(ray_handle_t* self, int op);
+int ray_waiting(ray_handle_t* self, int op);
+int ray_wake(ray_handle_t* self, int op);
+int ray_wake_all(ray_handle_t* self, int op);
+int ray_ready(ray_queue_t* queue, int fid);
+int ray_ready_next(ray_queue_t* queue);
+size_t ray_ready_count(ray_queue_t* queue);
 
 void ray_queue_post(ray_queue_t* self, ray_evt_t* evt);
+void ray_queue_post_local(ray_queue_t* self, ray_evt_t* evt);
+void ray_queue_defer(ray_queue_t* self, ray_handle_t* handle, int info, void* data);
 ray_evt_t* ray_queue_take(ray_queue_t* self);
 ray_evt_t* ray_queue_peek(ray_queue_t* self);
 ray_evt_t* ray_queue_next(ray_queue_t* self);
@@ -121,13 +283,30 @@ int ray_queue_interrupt(ray_queue_t* queue);
 ray_handle_t* ray_tcp_new(ray_queue_t* queue);
 int ray_tcp_init(ray_handle_t* self);
 int ray_tcp_bind(ray_handle_t* self, const char* host, int port);
+int ray_tcp_connect(ray_handle_t* self, const char* host, int port);
+
+void ray_queue_set_dns_ttl(ray_queue_t* queue, uint64_t ttl, uint64_t neg_ttl);
+
+int ray_pool_config(ray_queue_t* queue, int max_conns, uint64_t idle_ttl);
+int ray_pool_acquire(ray_queue_t* queue, const char* host, int port);
+int ray_pool_release(ray_handle_t* handle);
+int ray_pool_discard(ray_handle_t* handle);
+void ray_pool_stats(ray_queue_t* queue, ray_pool_stats_t* stats);
+void ray_pool_close(ray_queue_t* queue);
 
 int ray_read_start(ray_handle_t* self, size_t len);
 int ray_read_stop(ray_handle_t* self);
+void ray_queue_set_read_budget(ray_queue_t* self, uint32_t budget);
+uint64_t ray_queue_get_throttled(ray_queue_t* self);
+uint32_t ray_handle_get_throttled(ray_handle_t* self);
+void ray_queue_set_mem_limits(ray_queue_t* self, uint64_t soft, uint64_t hard);
+uint64_t ray_queue_mem_used(ray_queue_t* self, int cat);
+uint64_t ray_queue_mem_denied(ray_queue_t* self);
 
 int ray_write(ray_handle_t* self, const char* str, size_t len);
+int ray_writev(ray_handle_t* self, const ray_iov_t* iov, int cnt);
 
-int ray_listen(ray_handle_t* self, int backlog);
+int ray_listen(ray_handle_t* self, int backlog, int flags);
 int ray_accept(ray_handle_t* server, ray_handle_t* client);
 
 void ray_close(ray_handle_t* self);
@@ -142,9 +321,70 @@ int ray_idle_stop(ray_handle_t* self);
 
 ray_evt_t* ray_queue_next(ray_queue_t* self);
 void ray_evt_done(ray_evt_t* evt);
+void ray_queue_done(ray_queue_t* self, ray_evt_t* evt);
+const char* ray_type_name(int type);
+
+typedef enum {
+  RAY_TRACE_POST,
+  RAY_TRACE_TAKE,
+  RAY_TRACE_DONE,
+  RAY_TRACE_RUN_ENTER,
+  RAY_TRACE_RUN_EXIT,
+  RAY_TRACE_FS_SUBMIT,
+  RAY_TRACE_FS_COMPLETE
+} ray_trace_kind_t;
+
+int ray_trace_enable(ray_queue_t* self, size_t size);
+void ray_trace_disable(ray_queue_t* self);
+int ray_trace_dump(ray_queue_t* self, const char* path);
+
+uint32_t ray_handle_get_id(ray_handle_t* self);
+
+int ray_queue_set_fs_engine(ray_queue_t* queue, int engine);
+int ray_queue_get_fs_engine(ray_queue_t* queue);
+
+int ray_fs_open(ray_queue_t* queue, const char *path, const char* how, int mode);
+int ray_fs_close(ray_queue_t* queue, ray_file_t file);
+int ray_fs_read(ray_queue_t* queue, ray_file_t fh, char* buf, size_t len, int64_t ofs);
+int ray_fs_write(ray_queue_t* queue, ray_file_t file, void* buf, size_t len, int64_t ofs);
+int ray_fs_stat(ray_queue_t* queue, const char* path);
+int ray_fs_fstat(ray_queue_t* queue, ray_file_t file);
+int ray_fs_fsync(ray_queue_t* queue, ray_file_t file);
+int ray_fs_fdatasync(ray_queue_t* queue, ray_file_t file);
+
+ray_handle_t* ray_reader_new(ray_queue_t* queue, ray_file_t file, int64_t ofs, int depth);
+int ray_reader_pause(ray_handle_t* self);
+int ray_reader_resume(ray_handle_t* self);
+size_t ray_reader_chunk(ray_handle_t* self);
+
+uint32_t ray_queue_get_id(ray_queue_t* self);
+ray_handle_t* ray_mailbox_new(ray_queue_t* queue);
+ray_addr_t ray_mailbox_addr(ray_handle_t* self);
+ray_mail_t* ray_mail_new(size_t size);
+void ray_mail_free(ray_mail_t* mail);
+int ray_mail_send(ray_handle_t* from, ray_addr_t to, ray_mail_t* mail);
+ray_handle_t* ray_link_new(ray_queue_t* queue, ray_file_t fd);
+int ray_link_send(ray_handle_t* self, ray_handle_t* from, ray_addr_t to, ray_mail_t* mail);
+
+ray_handle_t* ray_log_new(ray_queue_t* queue, ray_file_t file, int64_t ofs);
+int ray_log_config(ray_handle_t* self, size_t group, uint64_t window);
+int ray_log_append(ray_handle_t* self, const void* data, size_t len, uint64_t* seq);
+int ray_log_flush(ray_handle_t* self);
+uint64_t ray_log_durable(ray_handle_t* self);
+uint64_t ray_log_syncs(ray_handle_t* self);
+
+int ray_fs_mmap(ray_queue_t* queue, const char* path, int advice);
+int ray_fs_munmap(ray_queue_t* queue, void* base, size_t size);
+int ray_madvise(void* base, size_t size, int advice);
+
+int ray_fs_cache_init(ray_queue_t* queue, size_t max_ents, int64_t neg_ttl);
+int ray_fs_cache_open(ray_queue_t* queue, const char* path, ray_stat_t* stat);
+int ray_fs_cache_close(ray_queue_t* queue, ray_file_t fd);
 
-int  ray_handle_get_id(ray_handle_t* self);
-void ray_handle_set_id(ray_handle_t* self, int id);
+ray_fs_batch_t* ray_fs_batch_new(ray_queue_t* queue, size_t size);
+int ray_fs_batch_add(ray_fs_batch_t* self, int op, const char* path);
+int ray_fs_batch_submit(ray_fs_batch_t* self, size_t chunk);
+void ray_fs_batch_free(ray_fs_batch_t* self);
 
 ]]
 
@@ -4,55 +4,574 @@
 
 #include "ray.h"
 
-static ray_ctx_t* _RAY_CTX;
+#if LUA_VERSION_NUM < 502
+#  define lray_setfuncs(L, l) luaL_register(L, NULL, l)
+#else
+#  define lray_setfuncs(L, l) luaL_setfuncs(L, l, 0)
+#endif
 
-static int timer_new(lua_State* L) {
-  ray_agent_t* self = (ray_agent_t*)lua_newuserdata(L, sizeof(ray_agent_t));
-  ray_agent_init(self, _RAY_CTX);
-  ray_timer_init(self);
+#define LRAY_QUEUE  "ray.queue"
+#define LRAY_HANDLE "ray.handle"
+
+/* events dispatched per loop wakeup before polling again */
+#define LRAY_BATCH 64
+
+typedef struct lray_queue_s {
+  ray_queue_t* queue;   /* NULL once freed */
+  int          ref;     /* callback object for handle-less (fs) events */
+  int          boxes;   /* set of the boxes of its handles */
+} lray_queue_t;
+
+/* Boxes live in the registry from creation until RAY_CLOSE, the C handle
+   points back at its box through `data`. */
+typedef struct lray_handle_s {
+  ray_handle_t* handle;
+  lray_queue_t* owner;
+  int           self;   /* registry ref keeping this box alive */
+  int           ref;    /* callback object */
+  int           wref;   /* strings pinned by in-flight writes */
+  int           whead;
+  int           wtail;
+} lray_handle_t;
+
+/* callback names indexed by ray_type_t, kept interned in the registry */
+static int _LRAY_NAMES = LUA_NOREF;
+
+static const char* lray_evt_name(int type) {
+  switch (type) {
+    case RAY_ERROR:      return "on_error";
+    case RAY_READ:       return "on_read";
+    case RAY_WRITE:      return "on_write";
+    case RAY_CLOSE:      return "on_close";
+    case RAY_CONNECTION: return "on_connection";
+    case RAY_TIMER:      return "on_timer";
+    case RAY_IDLE:       return "on_idle";
+    case RAY_CONNECT:    return "on_connect";
+    case RAY_MESSAGE:    return "on_message";
+    default:             return "on_event";
+  }
+}
+
+static lray_queue_t* lray_check_queue(lua_State* L, int idx) {
+  lray_queue_t* q = (lray_queue_t*)luaL_checkudata(L, idx, LRAY_QUEUE);
+  if (!q->queue) luaL_error(L, "attempt to use a freed queue");
+  return q;
+}
+
+static lray_handle_t* lray_check_handle(lua_State* L, int idx) {
+  lray_handle_t* box = (lray_handle_t*)luaL_checkudata(L, idx, LRAY_HANDLE);
+  if (!box->handle) luaL_error(L, "attempt to use a closed handle");
+  return box;
+}
+
+/* wraps `handle` in a box and binds it to the callback object at `obj`,
+   0 leaves it unbound until attach() */
+static lray_handle_t* lray_handle_push(lua_State* L, lray_queue_t* q, ray_handle_t* handle, int obj) {
+  if (!handle) {
+    luaL_error(L, "could not create handle");
+    return NULL;
+  }
+  lray_handle_t* box = (lray_handle_t*)lua_newuserdata(L, sizeof(lray_handle_t));
+  box->handle = handle;
+  box->owner  = q;
+  box->whead  = 1;
+  box->wtail  = 1;
+  luaL_getmetatable(L, LRAY_HANDLE);
+  lua_setmetatable(L, -2);
+
+  if (obj) {
+    lua_pushvalue(L, obj);
+    box->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  else {
+    box->ref = LUA_REFNIL;
+  }
+
+  lua_newtable(L);
+  box->wref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  lua_pushvalue(L, -1);
+  box->self = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, q->boxes);
+  lua_pushvalue(L, -2);
+  lua_pushboolean(L, 1);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+
+  handle->data = box;
+  return box;
+}
+
+/* lets go of the box, its handle is left to the caller */
+static void lray_handle_unbox(lua_State* L, lray_handle_t* box) {
+  lua_rawgeti(L, LUA_REGISTRYINDEX, box->owner->boxes);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, box->self);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  luaL_unref(L, LUA_REGISTRYINDEX, box->wref);
+  luaL_unref(L, LUA_REGISTRYINDEX, box->ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, box->self);
+  box->handle = NULL;
+}
+
+static void lray_handle_release(lua_State* L, lray_handle_t* box) {
+  ray_handle_t* handle = box->handle;
+  lray_handle_unbox(L, box);
+  ray_handle_free(handle);
+}
+
+/* an auto-accepted client nobody will pick up, boxed so RAY_CLOSE frees it */
+static void lray_reject(lua_State* L, lray_queue_t* q, ray_evt_t* evt) {
+  if (evt->type != RAY_CONNECTION || evt->info <= 0) return;
+  ray_handle_t* client = ray_handle_get(q->queue, evt->info);
+  if (!client) return;
+  lray_handle_push(L, q, client, 0);
+  lua_pop(L, 1);
+  ray_close(client);
+}
+
+/* Pushes the callback and its arguments for `evt`, retires the event and
+   only then calls into Lua so an error can't leave it in the ring. */
+static void lray_dispatch(lua_State* L, lray_queue_t* q, ray_evt_t* evt) {
+  ray_handle_t*  self = ray_handle_get(q->queue, evt->id);
+  lray_handle_t* box  = self ? (lray_handle_t*)self->data : NULL;
+  int nargs = 0;
+  int base  = lua_gettop(L);
+
+  ray_handle_t*  client = NULL;
+
+  if (evt->id && !box) {
+    lray_reject(L, q, evt);
+    ray_queue_done(q->queue, evt);
+    return;
+  }
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, box ? box->ref : q->ref);
+  if (lua_isnil(L, -1)) {
+    /* unbound handles, rejected clients among them, still need freeing */
+    int type = evt->type;
+    lua_settop(L, base);
+    lray_reject(L, q, evt);
+    ray_queue_done(q->queue, evt);
+    if (box && type == RAY_CLOSE) lray_handle_release(L, box);
+    return;
+  }
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, _LRAY_NAMES);
+  lua_rawgeti(L, -1, evt->type);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_pushstring(L, lray_evt_name(evt->type));
+  }
+  lua_remove(L, -2);
+  lua_gettable(L, -2);
+  lua_insert(L, -2);
+
+  switch (evt->type) {
+    case RAY_READ: {
+      lua_pushlstring(L, (const char*)evt->data, evt->info);
+      nargs = 1;
+      break;
+    }
+    case RAY_ERROR: {
+      lua_pushinteger(L, evt->info);
+      lua_pushstring(L, ray_err_name(evt->info));
+      nargs = 2;
+      break;
+    }
+    case RAY_WRITE: {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, box->wref);
+      lua_pushnil(L);
+      lua_rawseti(L, -2, box->whead++);
+      lua_pop(L, 1);
+      lua_pushinteger(L, evt->info);
+      nargs = 1;
+      break;
+    }
+    case RAY_CONNECTION: {
+      /* auto-accepted clients arrive unbound, see attach() */
+      if (evt->info > 0) client = ray_handle_get(q->queue, evt->info);
+      lua_pushinteger(L, client ? 0 : evt->info);
+      nargs = 1;
+      if (client) {
+        lray_handle_push(L, q, client, 0);
+        nargs = 2;
+      }
+      break;
+    }
+    case RAY_CONNECT: {
+      lua_pushinteger(L, evt->info);
+      nargs = 1;
+      break;
+    }
+    case RAY_MESSAGE: {
+      ray_mail_t* mail = (ray_mail_t*)evt->data;
+      lua_pushlstring(L, (const char*)mail->buf.base, mail->len);
+      lua_pushnumber(L, (lua_Number)mail->from);
+      nargs = 2;
+      break;
+    }
+    case RAY_CLOSE:
+    case RAY_TIMER:
+    case RAY_IDLE: {
+      break;
+    }
+    default: {
+      lua_pushinteger(L, evt->type);
+      lua_pushinteger(L, evt->info);
+      nargs = 2;
+    }
+  }
+
+  int type = evt->type;
+  ray_queue_done(q->queue, evt);
+
+  if (type == RAY_CLOSE) lray_handle_release(L, box);
+
+  if (lua_isnil(L, base + 1)) {
+    lua_settop(L, base);
+    if (client) ray_close(client);
+    return;
+  }
+  lua_call(L, nargs + 1, 0);
+}
+
+static int lray_queue_new(lua_State* L) {
+  size_t size = (size_t)luaL_optinteger(L, 1, 1024);
+  lray_queue_t* q = (lray_queue_t*)lua_newuserdata(L, sizeof(lray_queue_t));
+  q->queue = ray_queue_new(size);
+  q->ref   = LUA_NOREF;
+  lua_newtable(L);
+  q->boxes = luaL_ref(L, LUA_REGISTRYINDEX);
+  luaL_getmetatable(L, LRAY_QUEUE);
+  lua_setmetatable(L, -2);
+  if (!lua_isnoneornil(L, 2)) {
+    lua_pushvalue(L, 2);
+    q->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
   return 1;
 }
 
-static int lray_run(lua_State* L) {
+/* queue:free(), also its __gc. Boxes of handles still open are closed for
+   use, their handles go with the queue. */
+static int lray_queue_free(lua_State* L) {
+  lray_queue_t* q = (lray_queue_t*)luaL_checkudata(L, 1, LRAY_QUEUE);
+  if (!q->queue) return 0;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, q->boxes);
   for (;;) {
-    ray_evt_t* evt = ray_next(_RAY_CTX);
-    int id = ray_get_id(evt->self);
-    lua_getfield(L, LUA_REGISTRYINDEX, id);
-    switch (evt->type) {
-      case RAY_TIMER: {
-        lua_getfield(L, -1, "on_timer");
-        lua_call(L, 1, 0);
-        break;
-      }
-      default {
-        return luaL_error(L, "unhandled event type");
-      }
+    lua_pushnil(L);
+    if (!lua_next(L, -2)) break;
+    lua_pop(L, 1);
+    lray_handle_unbox(L, (lray_handle_t*)lua_touserdata(L, -1));
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  luaL_unref(L, LUA_REGISTRYINDEX, q->boxes);
+  luaL_unref(L, LUA_REGISTRYINDEX, q->ref);
+  ray_queue_free(q->queue);
+  q->queue = NULL;
+  return 0;
+}
+
+/* dispatches one batch of events, returns how many or 0 once idle */
+static int lray_queue_step(lua_State* L) {
+  lray_queue_t* q = lray_check_queue(L, 1);
+  ray_evt_t* evt = ray_queue_next(q->queue);
+  int n = 0;
+  while (evt) {
+    lray_dispatch(L, q, evt);
+    if (++n == LRAY_BATCH) break;
+    evt = ray_queue_take(q->queue);
+  }
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+static int lray_queue_run(lua_State* L) {
+  lray_queue_t* q = lray_check_queue(L, 1);
+  for (;;) {
+    ray_evt_t* evt = ray_queue_next(q->queue);
+    if (!evt) break;
+    int n = 0;
+    do {
+      lray_dispatch(L, q, evt);
+    } while (++n < LRAY_BATCH && (evt = ray_queue_take(q->queue)));
+  }
+  return 0;
+}
+
+static int lray_queue_tcp(lua_State* L) {
+  lray_queue_t* q = lray_check_queue(L, 1);
+  lray_handle_push(L, q, ray_tcp_new(q->queue), 2);
+  return 1;
+}
+
+static int lray_queue_timer(lua_State* L) {
+  lray_queue_t* q = lray_check_queue(L, 1);
+  lray_handle_push(L, q, ray_timer_new(q->queue), 2);
+  return 1;
+}
+
+static int lray_queue_idle(lua_State* L) {
+  lray_queue_t* q = lray_check_queue(L, 1);
+  lray_handle_push(L, q, ray_idle_new(q->queue), 2);
+  return 1;
+}
+
+/* queue:mailbox(obj), on_message(data, from) follows for each message */
+static int lray_queue_mailbox(lua_State* L) {
+  lray_queue_t* q = lray_check_queue(L, 1);
+  lray_handle_push(L, q, ray_mailbox_new(q->queue), 2);
+  return 1;
+}
+
+/* queue:trace(on, size) toggles the event trace ring */
+static int lray_queue_trace(lua_State* L) {
+  lray_queue_t* q = lray_check_queue(L, 1);
+  int rc = 0;
+  if (lua_toboolean(L, 2)) {
+    rc = ray_trace_enable(q->queue, (size_t)luaL_optinteger(L, 3, 0));
+  }
+  else {
+    ray_trace_disable(q->queue);
+  }
+  lua_pushinteger(L, rc);
+  return 1;
+}
+
+/* queue:dump(path) writes the trace ring as Chrome trace JSON */
+static int lray_queue_dump(lua_State* L) {
+  lray_queue_t* q = lray_check_queue(L, 1);
+  lua_pushinteger(L, ray_trace_dump(q->queue, luaL_checkstring(L, 2)));
+  return 1;
+}
+
+/* timer:start(timeo, repeat) or idle:start() */
+static int lray_handle_start(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  int rc;
+  switch (box->handle->u.handle.type) {
+    case UV_IDLE: {
+      rc = ray_idle_start(box->handle);
+      break;
+    }
+    case UV_TIMER: {
+      int64_t timeo  = (int64_t)luaL_checknumber(L, 2);
+      int64_t repeat = (int64_t)luaL_optnumber(L, 3, 0);
+      rc = ray_timer_start(box->handle, timeo, repeat);
+      break;
+    }
+    default: {
+      return luaL_error(L, "start is only for timers and idles");
     }
   }
+  lua_pushinteger(L, rc);
+  return 1;
+}
+
+static int lray_handle_stop(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  int rc;
+  switch (box->handle->u.handle.type) {
+    case UV_IDLE: {
+      rc = ray_idle_stop(box->handle);
+      break;
+    }
+    case UV_TIMER: {
+      rc = ray_timer_stop(box->handle);
+      break;
+    }
+    default: {
+      return luaL_error(L, "stop is only for timers and idles");
+    }
+  }
+  lua_pushinteger(L, rc);
+  return 1;
+}
+
+static int lray_handle_bind(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  const char* host = luaL_checkstring(L, 2);
+  int port = (int)luaL_checkinteger(L, 3);
+  lua_pushinteger(L, ray_tcp_bind(box->handle, host, port));
+  return 1;
+}
+
+/* handle:connect(host, port), on_connect(status) follows */
+static int lray_handle_connect(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  const char* host = luaL_checkstring(L, 2);
+  int port = (int)luaL_checkinteger(L, 3);
+  lua_pushinteger(L, ray_tcp_connect(box->handle, host, port));
+  return 1;
+}
+
+/* server:listen(backlog, flags), see ray.ACCEPT_AUTO and ray.ACCEPT_READ */
+static int lray_handle_listen(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  int backlog = (int)luaL_optinteger(L, 2, 128);
+  int flags   = (int)luaL_optinteger(L, 3, 0);
+  lua_pushinteger(L, ray_listen(box->handle, backlog, flags));
+  return 1;
+}
+
+/* handle:attach(obj) rebinds the handle's callbacks to `obj` */
+static int lray_handle_attach(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  luaL_checkany(L, 2);
+  luaL_unref(L, LUA_REGISTRYINDEX, box->ref);
+  lua_pushvalue(L, 2);
+  box->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 0;
+}
+
+/* server:accept(obj) -> client handle bound to `obj` */
+static int lray_handle_accept(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  lray_handle_t* client;
+  client = lray_handle_push(L, box->owner, ray_tcp_new(box->handle->queue), 2);
+  int rc = ray_accept(box->handle, client->handle);
+  if (rc) {
+    ray_close(client->handle);
+    lua_pushnil(L);
+    lua_pushinteger(L, rc);
+    return 2;
+  }
+  return 1;
+}
+
+static int lray_handle_read_start(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  lua_pushinteger(L, ray_read_start(box->handle));
+  return 1;
+}
+
+static int lray_handle_read_stop(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  lua_pushinteger(L, ray_read_stop(box->handle));
+  return 1;
+}
+
+/* the string is pinned until its RAY_WRITE, writes complete in order */
+static int lray_handle_write(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  size_t len;
+  const char* str = luaL_checklstring(L, 2, &len);
+  int rc = ray_write(box->handle, str, len);
+  if (rc == 0) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, box->wref);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, box->wtail++);
+    lua_pop(L, 1);
+  }
+  lua_pushinteger(L, rc);
+  return 1;
+}
+
+static int lray_handle_close(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  ray_close(box->handle);
+  return 0;
+}
+
+static int lray_handle_id(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  lua_pushnumber(L, ray_handle_get_id(box->handle));
+  return 1;
+}
+
+static int lray_handle_addr(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  lua_pushnumber(L, (lua_Number)ray_mailbox_addr(box->handle));
+  return 1;
+}
+
+/* mailbox:send(addr, data) */
+static int lray_handle_send(lua_State* L) {
+  lray_handle_t* box = lray_check_handle(L, 1);
+  ray_addr_t to = (ray_addr_t)luaL_checknumber(L, 2);
+  size_t len;
+  const char* str = luaL_checklstring(L, 3, &len);
+  ray_mail_t* mail = ray_mail_new(len);
+  if (!mail) return luaL_error(L, "out of memory");
+  ray_buf_write(&mail->buf, (uint8_t*)str, len);
+  lua_pushinteger(L, ray_mail_send(box->handle, to, mail));
+  return 1;
+}
+
+static int lray_strerror(lua_State* L) {
+  lua_pushstring(L, ray_strerror((int)luaL_checkinteger(L, 1)));
+  return 1;
 }
 
 static luaL_Reg lib_funcs[] = {
-  {"run",       lray_run},
-  {NULL,        NULL}
+  {"queue",       lray_queue_new},
+  {"strerror",    lray_strerror},
+  {NULL,          NULL}
+};
+
+static luaL_Reg queue_meths[] = {
+  {"run",         lray_queue_run},
+  {"step",        lray_queue_step},
+  {"tcp",         lray_queue_tcp},
+  {"timer",       lray_queue_timer},
+  {"idle",        lray_queue_idle},
+  {"mailbox",     lray_queue_mailbox},
+  {"trace",       lray_queue_trace},
+  {"dump",        lray_queue_dump},
+  {"free",        lray_queue_free},
+  {"__gc",        lray_queue_free},
+  {NULL,          NULL}
 };
 
-static luaL_Reg ctx_meths[] = {
-  {"next",      ctx_next},
-  {NULL,        NULL}
+static luaL_Reg handle_meths[] = {
+  {"start",       lray_handle_start},
+  {"stop",        lray_handle_stop},
+  {"bind",        lray_handle_bind},
+  {"connect",     lray_handle_connect},
+  {"listen",      lray_handle_listen},
+  {"accept",      lray_handle_accept},
+  {"attach",      lray_handle_attach},
+  {"read_start",  lray_handle_read_start},
+  {"read_stop",   lray_handle_read_stop},
+  {"write",       lray_handle_write},
+  {"close",       lray_handle_close},
+  {"id",          lray_handle_id},
+  {"addr",        lray_handle_addr},
+  {"send",        lray_handle_send},
+  {NULL,          NULL}
 };
 
-LUALIB_API int luaopen_ray(lua_State* L) {
+LUALIB_API int luaopen_luaray(lua_State* L) {
+  int type;
   lua_settop(L, 0);
 
-  _RAY_CTX = ray_ctx_new(1024);
+  lua_newtable(L);
+  for (type = RAY_CUSTOM; type <= RAY_MESSAGE; type++) {
+    lua_pushstring(L, lray_evt_name(type));
+    lua_rawseti(L, -2, type);
+  }
+  _LRAY_NAMES = luaL_ref(L, LUA_REGISTRYINDEX);
 
-  luaL_newmetatable(L, "ray.ctx");
-  luaL_register(L, NULL, ctx_meths);
+  luaL_newmetatable(L, LRAY_QUEUE);
+  lray_setfuncs(L, queue_meths);
   lua_pushvalue(L, -1);
   lua_setfield(L, -2, "__index");
   lua_pop(L, 1);
 
-  luaL_register(L, "ray", lib_funcs);
+  luaL_newmetatable(L, LRAY_HANDLE);
+  lray_setfuncs(L, handle_meths);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  lray_setfuncs(L, lib_funcs);
+  lua_pushinteger(L, RAY_ACCEPT_AUTO);
+  lua_setfield(L, -2, "ACCEPT_AUTO");
+  lua_pushinteger(L, RAY_ACCEPT_READ);
+  lua_setfield(L, -2, "ACCEPT_READ");
   return 1;
 }
-
@@ -9,7 +9,7 @@ const char* ray_err_name(int code) {
 
 ray_evt_t ray_evt_init(ray_handle_t* h, ray_type_t t, int i, void* d) {
   ray_evt_t evt;
-  evt.self = h;
+  evt.id   = h ? h->id : 0;
   evt.type = t;
   evt.info = i;
   evt.data = d;
@@ -17,8 +17,14 @@ ray_evt_t ray_evt_init(ray_handle_t* h, ray_type_t t, int i, void* d) {
   return evt;
 }
 
+/* messages from other threads, see ray_mail_send */
 void ray_queue_async_cb(uv_async_t* async, int status) {
-  (void)async;
+  ray_queue_t* queue = container_of(async, ray_queue_t, async);
+  (void)status;
+  ray_mail_drain(queue);
+}
+void ray_queue_kick_cb(uv_idle_t* idle, int status) {
+  (void)idle;
   (void)status;
 }
 void ray_queue_timer_cb(uv_timer_t* timer, int status) {
@@ -26,6 +32,188 @@ void ray_queue_timer_cb(uv_timer_t* timer, int status) {
   ray_queue_interrupt(queue);
 }
 
+/* ========================================================================== */
+/* handle slabs                                                               */
+/* ========================================================================== */
+#define RAY_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+size_t ray_slab_size(size_t size) {
+  size += offsetof(ray_handle_t, u);
+  return (size + RAY_CACHE_LINE - 1) & ~(size_t)(RAY_CACHE_LINE - 1);
+}
+
+void ray_slab_init(ray_queue_t* queue) {
+  int i;
+  size_t small = sizeof(uv_timer_t);
+  small = RAY_MAX(small, sizeof(uv_idle_t));
+  small = RAY_MAX(small, sizeof(uv_prepare_t));
+  small = RAY_MAX(small, sizeof(uv_check_t));
+  small = RAY_MAX(small, sizeof(uv_async_t));
+  small = RAY_MAX(small, sizeof(uv_poll_t));
+  small = RAY_MAX(small, sizeof(uv_fs_event_t));
+  small = RAY_MAX(small, sizeof(uv_fs_poll_t));
+
+  memset(queue->slabs, 0, sizeof(queue->slabs));
+  for (i = 0; i < RAY_SLAB_MAX; i++) queue->slabs[i].queue = queue;
+  queue->slabs[RAY_SLAB_SMALL].size  = ray_slab_size(small);
+  queue->slabs[RAY_SLAB_STREAM].size =
+    ray_slab_size(RAY_MAX(sizeof(uv_tcp_t), sizeof(uv_pipe_t)));
+  queue->slabs[RAY_SLAB_UDP].size    = ray_slab_size(sizeof(uv_udp_t));
+  queue->slabs[RAY_SLAB_LARGE].size  = ray_slab_size(sizeof(union ray_handle_u));
+
+  /* waiter pool, its nodes aren't handles so they don't get the header */
+  memset(&queue->waiters, 0, sizeof(queue->waiters));
+  queue->waiters.queue = queue;
+  queue->waiters.size  = sizeof(ray_waiter_t);
+}
+
+void ray_slab_destroy(ray_slab_t* slab) {
+  size_t i;
+  for (i = 0; i < slab->nchunks; i++) {
+#ifndef _WIN32
+    free(slab->chunks[i]);
+#else
+    _aligned_free(slab->chunks[i]);
+#endif
+  }
+  free(slab->chunks);
+  ray_mem_uncharge(slab->queue, RAY_MEM_HANDLE, slab->nchunks * slab->size * RAY_SLAB_CHUNK);
+}
+
+void ray_slab_free(ray_queue_t* queue) {
+  int i;
+  for (i = 0; i < RAY_SLAB_MAX; i++) ray_slab_destroy(&queue->slabs[i]);
+  ray_slab_destroy(&queue->waiters);
+}
+
+int ray_slab_class(int type) {
+  switch (type) {
+    case UV_TCP:
+    case UV_NAMED_PIPE:
+      return RAY_SLAB_STREAM;
+    case UV_UDP:
+      return RAY_SLAB_UDP;
+    case UV_TIMER:
+    case UV_IDLE:
+    case UV_PREPARE:
+    case UV_CHECK:
+    case UV_ASYNC:
+    case UV_POLL:
+    case UV_FS_EVENT:
+    case UV_FS_POLL:
+    case UV_FILE:     /* streaming readers, which don't use `u` */
+      return RAY_SLAB_SMALL;
+    default:
+      return RAY_SLAB_LARGE;
+  }
+}
+
+int ray_slab_grow(ray_slab_t* slab) {
+  void* chunk = NULL;
+  size_t i;
+  size_t bytes = slab->size * RAY_SLAB_CHUNK;
+  if (ray_mem_charge(slab->queue, RAY_MEM_HANDLE, bytes, 1)) return UV__ENOMEM;
+#ifndef _WIN32
+  if (posix_memalign(&chunk, RAY_CACHE_LINE, bytes)) chunk = NULL;
+#else
+  chunk = _aligned_malloc(bytes, RAY_CACHE_LINE);
+#endif
+  if (!chunk) {
+    ray_mem_uncharge(slab->queue, RAY_MEM_HANDLE, bytes);
+    return UV__ENOMEM;
+  }
+  slab->chunks = realloc(slab->chunks, (slab->nchunks + 1) * sizeof(void*));
+  slab->chunks[slab->nchunks++] = chunk;
+
+  /* thread the new objects onto the free list, lowest address first */
+  for (i = RAY_SLAB_CHUNK; i > 0; i--) {
+    void** obj = (void**)((char*)chunk + (i - 1) * slab->size);
+    *obj = slab->free;
+    slab->free = obj;
+  }
+  return 0;
+}
+
+void* ray_slab_alloc(ray_slab_t* slab) {
+  if (!slab->free && ray_slab_grow(slab)) return NULL;
+  void** obj = (void**)slab->free;
+  slab->free = *obj;
+  slab->nused++;
+  memset(obj, 0, slab->size);
+  return obj;
+}
+
+void ray_slab_release(ray_slab_t* slab, void* ptr) {
+  *(void**)ptr = slab->free;
+  slab->free = ptr;
+  slab->nused--;
+}
+
+/* queues by id, so that messages can be addressed to them from anywhere,
+   and how many senders hold on to each slot, see ray_queue_acquire */
+static ray_queue_t* ray_queues[RAY_MAX_QUEUES];
+static uint32_t     ray_queue_refs[RAY_MAX_QUEUES];
+
+/* 0 when the table is full, the queue then can't receive messages */
+uint32_t ray_queue_register(ray_queue_t* self) {
+  uint32_t i;
+  for (i = 0; i < RAY_MAX_QUEUES; i++) {
+    ray_queue_t* none = NULL;
+    if (__atomic_compare_exchange_n(&ray_queues[i], &none, self, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+/* Once the slot is cleared no new sender gets the queue, and the ones that
+   already have it are waited out, so their pushes are in the inbox. */
+void ray_queue_unregister(ray_queue_t* self) {
+  ray_mail_t* mail;
+  if (self->qid) {
+    __atomic_store_n(&ray_queues[self->qid - 1], NULL, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&ray_queue_refs[self->qid - 1], __ATOMIC_SEQ_CST)) {
+#ifndef _WIN32
+      sched_yield();
+#else
+      SwitchToThread();
+#endif
+    }
+  }
+  mail = __atomic_exchange_n(&self->inbox, NULL, __ATOMIC_ACQUIRE);
+  while (mail) {
+    ray_mail_t* next = mail->next;
+    ray_mail_free(mail);
+    mail = next;
+  }
+  while ((mail = self->mail_head)) {
+    self->mail_head = mail->next;
+    ray_mail_free(mail);
+  }
+}
+
+/* unpinned, only safe where the queue can't be freed meanwhile */
+ray_queue_t* ray_queue_get(uint32_t qid) {
+  if (qid == 0 || qid > RAY_MAX_QUEUES) return NULL;
+  return __atomic_load_n(&ray_queues[qid - 1], __ATOMIC_ACQUIRE);
+}
+
+/* the queue at `qid`, kept from being freed until ray_queue_release */
+ray_queue_t* ray_queue_acquire(uint32_t qid) {
+  ray_queue_t* queue;
+  if (qid == 0 || qid > RAY_MAX_QUEUES) return NULL;
+  __atomic_add_fetch(&ray_queue_refs[qid - 1], 1, __ATOMIC_SEQ_CST);
+  queue = __atomic_load_n(&ray_queues[qid - 1], __ATOMIC_SEQ_CST);
+  if (!queue) ray_queue_release(qid);
+  return queue;
+}
+void ray_queue_release(uint32_t qid) {
+  __atomic_sub_fetch(&ray_queue_refs[qid - 1], 1, __ATOMIC_RELEASE);
+}
+uint32_t ray_queue_get_id(ray_queue_t* self) {
+  return self->qid;
+}
+
 ray_queue_t* ray_queue_new(size_t size) {
   ray_queue_t* self = (ray_queue_t*)malloc(sizeof(ray_queue_t));
   ray_queue_init(self, size + (size % 2));
@@ -38,11 +226,22 @@ int ray_queue_init(ray_queue_t* self, size_t size) {
   self->loop = loop;
   loop->data = (void*)self;
 
-  /* event pool */
-  self->nput_evts = 0;
-  self->nget_evts = 0;
-  self->size_evts = size;
-  self->evts = calloc(size, sizeof(ray_evt_t));
+  /* event lanes */
+  int i;
+  for (i = 0; i < RAY_LANE_MAX; i++) {
+    ray_lane_t* lane = &self->lanes[i];
+    lane->nput   = 0;
+    lane->nget   = 0;
+    lane->size   = size;
+    lane->evts   = calloc(size, sizeof(ray_evt_t));
+    lane->weight = i == RAY_LANE_IO ? 4 : 1;
+    lane->credit = lane->weight;
+  }
+  self->nevts = 0;
+  self->lane_policy = RAY_LANE_WRR;
+
+  self->tracing = 0;
+  memset(&self->trace, 0, sizeof(self->trace));
 
   /* message pool */
   self->nput_msgs = 0;
@@ -56,30 +255,325 @@ int ray_queue_init(ray_queue_t* self, size_t size) {
   uv_timer_init(loop, &self->timer);
   uv_unref((uv_handle_t*)&self->timer);
 
+  self->owner   = uv_thread_self();   /* until it runs, see ray_queue_next */
+  self->running = 0;
+  self->nlocal  = 0;
+  uv_idle_init(loop, &self->kick);
+  uv_unref((uv_handle_t*)&self->kick);
+
+  self->read_budget = 0;
+  self->turn        = 0;
+  self->nthrottled  = 0;
+  self->throttled   = NULL;
+  uv_prepare_init(loop, &self->prepare);
+  uv_unref((uv_handle_t*)&self->prepare);
+
+  memset(self->mem, 0, sizeof(self->mem));
+  self->mem_used    = 0;
+  self->mem_soft    = 0;
+  self->mem_hard    = 0;
+  self->nmem_denied = 0;
+  self->mem_parked  = 0;
+
+  /* handle table, slot 0 stays unused so that id 0 means "no handle" */
+  self->handles.size  = 64;
+  self->handles.used  = 1;
+  self->handles.free  = 0;
+  self->handles.tail  = 0;
+  self->handles.slots = calloc(self->handles.size, sizeof(ray_slot_t));
+
+  ray_slab_init(self);
+
+  self->ready.head = NULL;
+  self->ready.tail = NULL;
+  self->nready = 0;
+
+  self->inbox      = NULL;
+  self->mail_head  = NULL;
+  self->mail_tail  = NULL;
+  self->nmailboxes = 0;
+  self->qid        = ray_queue_register(self);
+
+  self->fcache = NULL;
+  self->dns    = NULL;
+  self->pool   = NULL;
+  self->uring  = NULL;
+
   return 0;
 }
 
 void ray_queue_free(ray_queue_t* self) {
-  free(self->evts);
+  ray_queue_unregister(self);
+  if (self->fcache) ray_fs_cache_free(self->fcache);
+  if (self->dns) ray_dns_free(self->dns);
+  if (self->pool) ray_pool_free(self->pool, 1);
+#ifdef RAY_USE_URING
+  if (self->uring) ray_uring_free(self->uring, 1);
+#endif
+  int i;
+  for (i = 0; i < RAY_LANE_MAX; i++) free(self->lanes[i].evts);
+  free(self->trace.ents);
   free(self->msgs);
+  free(self->handles.slots);
+  ray_slab_free(self);
   free(self);
 }
 
-ray_handle_t* ray_handle_new(ray_queue_t* queue) {
-  ray_handle_t* self = (ray_handle_t*)calloc(1, sizeof(ray_handle_t));
+uint32_t ray_htable_put(ray_htable_t* self, ray_handle_t* handle) {
+  uint32_t idx;
+  if (self->free) {
+    idx = self->free;
+    self->free = self->slots[idx].next;
+    if (!self->free) self->tail = 0;
+  }
+  else {
+    if (self->used == self->size) {
+      if (self->size > RAY_HANDLE_IDX_MASK) return 0;
+      self->size *= 2;
+      self->slots = realloc(self->slots, self->size * sizeof(ray_slot_t));
+      memset(self->slots + self->used, 0, self->used * sizeof(ray_slot_t));
+    }
+    idx = self->used++;
+  }
+  ray_slot_t* slot = &self->slots[idx];
+  if (slot->gen == 0) slot->gen = 1;
+  slot->handle = handle;
+  return (slot->gen << RAY_HANDLE_IDX_BITS) | idx;
+}
+void ray_htable_del(ray_htable_t* self, uint32_t id) {
+  uint32_t idx = id & RAY_HANDLE_IDX_MASK;
+  ray_slot_t* slot = &self->slots[idx];
+  slot->handle = NULL;
+  slot->gen    = (slot->gen + 1) & RAY_HANDLE_GEN_MASK;
+  if (slot->gen == 0) slot->gen = 1;
+  slot->next   = 0;
+  if (self->tail) self->slots[self->tail].next = idx;
+  else self->free = idx;
+  self->tail = idx;
+}
+
+/* `type` is the uv_handle_type the handle will be initialized as */
+ray_handle_t* ray_handle_new(ray_queue_t* queue, int type) {
+  int slab = ray_slab_class(type);
+  ray_handle_t* self = (ray_handle_t*)ray_slab_alloc(&queue->slabs[slab]);
+  if (!self) return NULL;
   self->queue = queue;
+  self->slab  = slab;
+  self->id    = ray_htable_put(&queue->handles, self);
+  if (!self->id) {
+    ray_slab_release(&queue->slabs[slab], self);
+    return NULL;
+  }
   return self;
 }
 void ray_handle_free(ray_handle_t* self) {
-  free(self);
+  ray_queue_t* queue = self->queue;
+  int op;
+  ray_unthrottle(self);
+  if (self->reader) ray_reader_free(self->reader);
+  if (self->log) ray_log_free(self->log);
+  if (self->link) ray_link_free(self->link);
+  /* fibers still parked here are made runnable and find the handle gone */
+  for (op = 0; op < RAY_WAIT_MAX; op++) ray_wake_all(self, op);
+  ray_htable_del(&queue->handles, self->id);
+  ray_slab_release(&queue->slabs[self->slab], self);
+}
+
+/* NULL once the handle has been freed, even if its slot was reused */
+ray_handle_t* ray_handle_get(ray_queue_t* queue, uint32_t id) {
+  uint32_t idx = id & RAY_HANDLE_IDX_MASK;
+  if (idx == 0 || idx >= queue->handles.used) return NULL;
+  ray_slot_t* slot = &queue->handles.slots[idx];
+  if (slot->gen != id >> RAY_HANDLE_IDX_BITS) return NULL;
+  return slot->handle;
+}
+
+/* grow the slab for `type` until `n` handles can be had without malloc */
+int ray_handle_reserve(ray_queue_t* queue, int type, size_t n) {
+  ray_slab_t* slab = &queue->slabs[ray_slab_class(type)];
+  while (slab->nchunks * RAY_SLAB_CHUNK - slab->nused < n) {
+    int rc = ray_slab_grow(slab);
+    if (rc) return rc;
+  }
+  return 0;
+}
+
+/* close callback for handles nobody will see a RAY_CLOSE for */
+void ray_free_cb(uv_handle_t* handle) {
+  ray_handle_free(container_of(handle, ray_handle_t, u));
+}
+
+/* ========================================================================== */
+/* wait queues                                                                */
+/* ========================================================================== */
+static void ray_waitq_push(ray_waitq_t* q, ray_waiter_t* w) {
+  w->next = NULL;
+  if (q->tail) q->tail->next = w;
+  else q->head = w;
+  q->tail = w;
+}
+static ray_waiter_t* ray_waitq_shift(ray_waitq_t* q) {
+  ray_waiter_t* w = q->head;
+  if (w) {
+    q->head = w->next;
+    if (!q->head) q->tail = NULL;
+  }
+  return w;
+}
+
+/* park fiber `fid` on operation `op` of this handle, FIFO order */
+int ray_wait(ray_handle_t* self, int op, int fid) {
+  if (op < 0 || op >= RAY_WAIT_MAX || fid <= 0) return UV__EINVAL;
+  ray_waiter_t* w = (ray_waiter_t*)ray_slab_alloc(&self->queue->waiters);
+  if (!w) return UV__ENOMEM;
+  w->fid = fid;
+  ray_waitq_push(&self->waits[op], w);
+  return 0;
+}
+
+/* unpark the oldest waiter and hand it to the caller, 0 if none */
+int ray_wait_pop(ray_handle_t* self, int op) {
+  if (op < 0 || op >= RAY_WAIT_MAX) return 0;
+  ray_waiter_t* w = ray_waitq_shift(&self->waits[op]);
+  if (!w) return 0;
+  int fid = w->fid;
+  ray_slab_release(&self->queue->waiters, w);
+  return fid;
+}
+
+int ray_waiting(ray_handle_t* self, int op) {
+  if (op < 0 || op >= RAY_WAIT_MAX) return 0;
+  return self->waits[op].head != NULL;
+}
+
+/* move the oldest waiter to the ready queue, returns its fid or 0 */
+int ray_wake(ray_handle_t* self, int op) {
+  if (op < 0 || op >= RAY_WAIT_MAX) return 0;
+  ray_waiter_t* w = ray_waitq_shift(&self->waits[op]);
+  if (!w) return 0;
+  ray_waitq_push(&self->queue->ready, w);
+  self->queue->nready++;
+  return w->fid;
+}
+
+/* splice every waiter onto the ready queue, returns how many were woken */
+int ray_wake_all(ray_handle_t* self, int op) {
+  if (op < 0 || op >= RAY_WAIT_MAX) return 0;
+  ray_waitq_t* q = &self->waits[op];
+  ray_waitq_t* r = &self->queue->ready;
+  ray_waiter_t* w;
+  int n = 0;
+  if (!q->head) return 0;
+  for (w = q->head; w; w = w->next) n++;
+  if (r->tail) r->tail->next = q->head;
+  else r->head = q->head;
+  r->tail = q->tail;
+  q->head = q->tail = NULL;
+  self->queue->nready += n;
+  return n;
+}
+
+int ray_ready(ray_queue_t* queue, int fid) {
+  if (fid <= 0) return UV__EINVAL;
+  ray_waiter_t* w = (ray_waiter_t*)ray_slab_alloc(&queue->waiters);
+  if (!w) return UV__ENOMEM;
+  w->fid = fid;
+  ray_waitq_push(&queue->ready, w);
+  queue->nready++;
+  return 0;
+}
+
+/* next runnable fiber, 0 once the ready queue is empty */
+int ray_ready_next(ray_queue_t* queue) {
+  ray_waiter_t* w = ray_waitq_shift(&queue->ready);
+  if (!w) return 0;
+  int fid = w->fid;
+  queue->nready--;
+  ray_slab_release(&queue->waiters, w);
+  return fid;
 }
+
+size_t ray_ready_count(ray_queue_t* queue) {
+  return queue->nready;
+}
+
 int ray_evt_count(ray_queue_t* self) {
-  if (self->nput_evts > self->nget_evts) {
-    return self->nput_evts - self->nget_evts;
+  return (int)self->nevts;
+}
+
+/* ========================================================================== */
+/* event lanes                                                                */
+/* ========================================================================== */
+int ray_lane_of(int type) {
+  switch (type) {
+    case RAY_TIMER:
+    case RAY_CONNECTION:
+    case RAY_CONNECT:
+      return RAY_LANE_CONTROL;
+    case RAY_WORK:
+    case RAY_IDLE:
+      return RAY_LANE_FS;
+    case RAY_MESSAGE:
+      return RAY_LANE_IO;
+    default:
+      return type >= RAY_FS_CUSTOM ? RAY_LANE_FS : RAY_LANE_IO;
+  }
+}
+
+/* RAY_ERROR without a handle is a failed fs operation, it goes where the
+   successes go so consumers matching fs events by order see it in place */
+int ray_evt_lane(const ray_evt_t* evt) {
+  if (evt->type == RAY_ERROR && evt->id == 0) return RAY_LANE_FS;
+  return ray_lane_of(evt->type);
+}
+
+int ray_queue_set_lane_policy(ray_queue_t* self, int policy) {
+  if (policy != RAY_LANE_WRR && policy != RAY_LANE_STRICT) return UV__EINVAL;
+  self->lane_policy = policy;
+  return 0;
+}
+
+/* events a lane may deliver per round under RAY_LANE_WRR */
+int ray_queue_set_lane_weight(ray_queue_t* self, int lane, int weight) {
+  if (lane < 0 || lane >= RAY_LANE_MAX || weight < 1) return UV__EINVAL;
+  self->lanes[lane].weight = weight;
+  self->lanes[lane].credit = weight;
+  return 0;
+}
+
+/* The lane to take from next, without spending credit. Control always goes
+   first: its events are few, and an accepted client's reads must not
+   overtake the RAY_CONNECTION announcing it. */
+ray_lane_t* ray_lane_pick(ray_queue_t* self) {
+  ray_lane_t* spent = NULL;
+  int i;
+  for (i = 0; i < RAY_LANE_MAX; i++) {
+    ray_lane_t* lane = &self->lanes[i];
+    if (lane->nput == lane->nget) continue;
+    if (self->lane_policy == RAY_LANE_STRICT || i == RAY_LANE_CONTROL) {
+      return lane;
+    }
+    if (lane->credit > 0) return lane;
+    if (!spent) spent = lane;
   }
-  else { // integer wrap
-    return self->nget_evts - self->nput_evts;
+  return spent;
+}
+
+ray_evt_t* ray_lane_shift(ray_queue_t* self, ray_lane_t* lane) {
+  ray_evt_t* evt = &lane->evts[lane->nget++ % lane->size];
+  self->nevts--;
+  if (self->lane_policy == RAY_LANE_WRR &&
+      lane != &self->lanes[RAY_LANE_CONTROL]) {
+    /* every busy lane used its share, start the next round */
+    if (lane->credit == 0) {
+      int i;
+      for (i = 0; i < RAY_LANE_MAX; i++) {
+        self->lanes[i].credit = self->lanes[i].weight;
+      }
+    }
+    lane->credit--;
   }
+  return evt;
 }
 
 ray_msg_t* ray_msg_next(ray_queue_t* self) {
@@ -92,58 +586,287 @@ void ray_msg_done(ray_msg_t* msg) {
 }
 
 void ray_queue_post(ray_queue_t* self, ray_evt_t* evt) {
-  assert(ray_evt_count(self) != self->size_evts);
-  if (ray_evt_count(self) == 0) {
-    ray_queue_interrupt(self);
-  }
-  ray_evt_t* next_evt_p = &self->evts[(self->nput_evts + 1) % self->size_evts];
+  if (self->nevts == 0) ray_queue_wake(self);
+  ray_queue_post_local(self, evt);
+}
+
+/* appends without waking anyone, for the owner thread outside of uv_run
+   where ray_queue_next finds the event before it polls */
+void ray_queue_post_local(ray_queue_t* self, ray_evt_t* evt) {
+  ray_lane_t* lane = &self->lanes[ray_evt_lane(evt)];
+  assert(lane->nput - lane->nget != lane->size);
+  ray_evt_t* next_evt_p = &lane->evts[(lane->nput + 1) % lane->size];
   assert(next_evt_p->data == NULL);
-  self->evts[self->nput_evts++ % self->size_evts] = *evt;
+  lane->evts[lane->nput++ % lane->size] = *evt;
+  self->nevts++;
+  RAY_TRACE_ADD(self, RAY_TRACE_POST, evt->id, evt->type, evt->info);
+}
+
+/* events for handles freed since they were posted are dropped here, and
+   reads left over from a pooled connection's previous lease */
+int ray_evt_stale(ray_queue_t* self, ray_evt_t* evt) {
+  if (evt->id == 0) return 0;
+  ray_handle_t* handle = ray_handle_get(self, evt->id);
+  if (!handle) return 1;
+  if (handle->nstale && (evt->type == RAY_READ || evt->type == RAY_ERROR)) {
+    handle->nstale--;
+    return 1;
+  }
+  return 0;
+}
+
+/* drops an event for a freed handle, clients auto-accepted for it go too */
+void ray_evt_drop(ray_queue_t* self, ray_evt_t* evt) {
+  if (evt->type == RAY_CONNECTION && evt->info > 0) {
+    ray_handle_t* client = ray_handle_get(self, evt->info);
+    if (client) uv_close(&client->u.handle, ray_free_cb);
+  }
+  ray_queue_done(self, evt);
 }
 
 ray_evt_t* ray_queue_take(ray_queue_t* self) {
-  if (ray_evt_count(self) == 0) return NULL;
-  return &self->evts[self->nget_evts++ % self->size_evts];
+  ray_lane_t* lane;
+  while ((lane = ray_lane_pick(self))) {
+    ray_evt_t* evt = ray_lane_shift(self, lane);
+    if (!ray_evt_stale(self, evt)) {
+      RAY_TRACE_ADD(self, RAY_TRACE_TAKE, evt->id, evt->type, evt->info);
+      return evt;
+    }
+    ray_evt_drop(self, evt);
+  }
+  return NULL;
 }
 ray_evt_t* ray_queue_peek(ray_queue_t* self) {
-  if (ray_evt_count(self) == 0) return NULL;
-  return &self->evts[self->nget_evts % self->size_evts];
+  ray_lane_t* lane;
+  while ((lane = ray_lane_pick(self))) {
+    ray_evt_t* evt = &lane->evts[lane->nget % lane->size];
+    if (!ray_evt_stale(self, evt)) return evt;
+    ray_evt_drop(self, ray_lane_shift(self, lane));
+  }
+  return NULL;
 }
+int ray_queue_run(ray_queue_t* self, uv_run_mode mode) {
+  RAY_TRACE_ADD(self, RAY_TRACE_RUN_ENTER, 0, RAY_UNKNOWN, mode);
+  self->running = 1;
+  int rc = uv_run(self->loop, mode);
+  self->running = 0;
+  RAY_TRACE_ADD(self, RAY_TRACE_RUN_EXIT, 0, RAY_UNKNOWN, rc);
+  if (uv_is_active((uv_handle_t*)&self->kick)) uv_idle_stop(&self->kick);
+  self->nlocal = 0;
+  return rc;
+}
+
+/* Events already queued are handed out without polling, up to
+   RAY_LOCAL_BUDGET in a row so that I/O isn't starved by events the
+   consumer keeps posting to itself. The calling thread becomes the owner,
+   a queue may be created on one thread and run on another. */
 ray_evt_t* ray_queue_next(ray_queue_t* self) {
+  ray_evt_t* evt;
   int uv_again = 0;
+  unsigned long self_id = uv_thread_self();
+  if (self->owner != self_id) {
+    __atomic_store_n(&self->owner, self_id, __ATOMIC_RELEASE);
+  }
+  if (self->mail_head) ray_mail_pump(self);
+  /* the loop may have nothing left to run the prepare callback for */
+  if (self->mem_parked && !ray_mem_tight(self)) ray_queue_resume(self);
+  if (self->nlocal < RAY_LOCAL_BUDGET && (evt = ray_queue_take(self))) {
+    self->nlocal++;
+    return evt;
+  }
   do {
     TRACE("try UV_RUN_NOWAIT\n");
-    uv_again = uv_run(self->loop, UV_RUN_NOWAIT);
-    if (ray_evt_count(self) != 0) break;
+    uv_again = ray_queue_run(self, UV_RUN_NOWAIT);
+    if ((evt = ray_queue_take(self))) return evt;
 
     TRACE("try UV_RUN_ONCE\n");
-    uv_again = uv_run(self->loop, UV_RUN_ONCE);
+    uv_again = ray_queue_run(self, UV_RUN_ONCE);
 
-    if (ray_evt_count(self) != 0) break;
+    if ((evt = ray_queue_take(self))) return evt;
   } while (uv_again);
-  if (ray_evt_count(self) != 0) return ray_queue_take(self);
   return NULL;
 }
 void ray_evt_done(ray_evt_t* evt) {
   TRACE("ray_evt_done: evt: %p, data: %p\n", evt, evt->data);
-  if (evt->data != NULL) free(evt->data);
+  if (evt->data != NULL) {
+    switch (evt->type) {
+      case RAY_FS_BATCH:
+        ray_fs_batch_free((ray_fs_batch_t*)evt->data);
+        break;
+      case RAY_MESSAGE:
+        ray_mail_free((ray_mail_t*)evt->data);
+        break;
+      case RAY_FS_READ:
+        /* reader buffers go back to their reader, others are the caller's */
+        if (evt->id) ray_reader_release(evt->data);
+        break;
+      case RAY_CUSTOM:
+      case RAY_FS_MMAP:
+        free(evt->data);
+        break;
+      default:
+        ray_mem_free(evt->data);
+    }
+  }
   evt->data = NULL;
 }
 
+/* ray_evt_done for an event taken from `self`, recorded when tracing */
+void ray_queue_done(ray_queue_t* self, ray_evt_t* evt) {
+  RAY_TRACE_ADD(self, RAY_TRACE_DONE, evt->id, evt->type, evt->info);
+  ray_evt_done(evt);
+}
+
 int ray_queue_interrupt(ray_queue_t* queue) {
   return uv_async_send(&queue->async);
 }
 
+/* Makes a uv_run in progress return instead of blocking in poll. On the
+   owner thread an idle handle does that without a syscall, and outside of
+   uv_run nothing is needed at all. */
+void ray_queue_wake(ray_queue_t* self) {
+  if (uv_thread_self() != __atomic_load_n(&self->owner, __ATOMIC_ACQUIRE)) {
+    ray_queue_interrupt(self);
+  }
+  else if (self->running && !uv_is_active((uv_handle_t*)&self->kick)) {
+    uv_idle_start(&self->kick, ray_queue_kick_cb);
+  }
+}
+
+/* a RAY_CUSTOM for `handle`, or the queue when NULL, from the owner thread,
+   `data` is released with free() */
+void ray_queue_defer(ray_queue_t* self, ray_handle_t* handle, int info, void* data) {
+  ray_evt_t evt = ray_evt_init(handle, RAY_CUSTOM, info, data);
+  ray_queue_post(self, &evt);
+}
+
+/* ========================================================================== */
+/* tracing                                                                    */
+/* ========================================================================== */
+#define RAY_TRACE_SIZE 65536
+
+static const char* ray_type_names[] = {
+  "UNKNOWN", "CUSTOM", "ERROR", "READ", "WRITE", "CLOSE", "CONNECTION",
+  "TIMER", "IDLE", "CONNECT", "SHUTDOWN", "WORK", "FS_CUSTOM",
+  "FS_ERROR", "FS_OPEN", "FS_CLOSE", "FS_READ", "FS_WRITE", "FS_SENDFILE", "FS_STAT",
+  "FS_LSTAT", "FS_FSTAT", "FS_FTRUNCATE", "FS_UTIME", "FS_FUTIME",
+  "FS_CHMOD", "FS_FCHMOD", "FS_FSYNC", "FS_FDATASYNC", "FS_UNLINK",
+  "FS_RMDIR", "FS_MKDIR", "FS_RENAME", "FS_READDIR", "FS_LINK", "FS_SYMLINK",
+  "FS_READLINK", "FS_CHOWN", "FS_FCHOWN", "FS_MMAP", "FS_MUNMAP", "FS_BATCH",
+  "MESSAGE"
+};
+
+const char* ray_type_name(int type) {
+  int n = (int)(sizeof(ray_type_names) / sizeof(ray_type_names[0]));
+  if (type < RAY_UNKNOWN || type + 1 >= n) return ray_type_names[0];
+  return ray_type_names[type + 1];
+}
+
+/* Starts recording into a ring of `size` entries, rounded up to a power of
+   two (0 picks a default). Turning it off keeps the ring for dumping. */
+int ray_trace_enable(ray_queue_t* self, size_t size) {
+  ray_trace_t* trace = &self->trace;
+  size_t n = 1;
+  if (!size) size = RAY_TRACE_SIZE;
+  while (n < size) n <<= 1;
+  if (n != trace->size) {
+    ray_trace_ent_t* ents = (ray_trace_ent_t*)malloc(n * sizeof(ray_trace_ent_t));
+    if (!ents) return UV__ENOMEM;
+    free(trace->ents);
+    trace->ents = ents;
+    trace->size = n;
+    trace->nput = 0;
+  }
+  self->tracing = 1;
+  return 0;
+}
+void ray_trace_disable(ray_queue_t* self) {
+  self->tracing = 0;
+}
+
+/* Numbers fs operations so that their submit and complete entries pair up,
+   whatever slot or memory the operation lives in. */
+uint32_t ray_trace_op(ray_queue_t* self) {
+  return self->trace.nops++;
+}
+
+void ray_trace_add(ray_queue_t* self, int kind, uint32_t id, int type, int32_t aux) {
+  ray_trace_t* trace = &self->trace;
+  ray_trace_ent_t* ent = &trace->ents[trace->nput++ & (trace->size - 1)];
+  ent->ts   = uv_hrtime();
+  ent->id   = id;
+  ent->aux  = aux;
+  ent->type = (int16_t)type;
+  ent->kind = (uint8_t)kind;
+}
+
+/* Writes the ring, oldest entry first, as Chrome trace event JSON for
+   chrome://tracing or Perfetto. Runs synchronously, it is meant for
+   offline inspection. */
+int ray_trace_dump(ray_queue_t* self, const char* path) {
+  static const char* cats[] = { "post", "take", "done" };
+  ray_trace_t* trace = &self->trace;
+  size_t i = trace->nput > trace->size ? trace->nput - trace->size : 0;
+  const char* sep = "";
+  FILE* out = fopen(path, "w");
+  if (!out) return -errno;
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (; i < trace->nput; i++) {
+    ray_trace_ent_t* ent = &trace->ents[i & (trace->size - 1)];
+    unsigned long long us  = ent->ts / 1000;
+    unsigned           frac = (unsigned)(ent->ts % 1000);
+    const char* name = ray_type_name(ent->type);
+
+    fprintf(out, "%s\n{\"pid\":1,\"tid\":1,\"ts\":%llu.%03u,", sep, us, frac);
+    sep = ",";
+    switch (ent->kind) {
+      case RAY_TRACE_RUN_ENTER:
+        fprintf(out, "\"ph\":\"B\",\"name\":\"uv_run\","
+                "\"args\":{\"mode\":%d}}", (int)ent->aux);
+        break;
+      case RAY_TRACE_RUN_EXIT:
+        fprintf(out, "\"ph\":\"E\",\"name\":\"uv_run\","
+                "\"args\":{\"more\":%d}}", (int)ent->aux);
+        break;
+      case RAY_TRACE_FS_SUBMIT:
+      case RAY_TRACE_FS_COMPLETE:
+        fprintf(out, "\"ph\":\"%s\",\"cat\":\"fs\",\"name\":\"%s\","
+                "\"id\":\"0x%x\"}",
+                ent->kind == RAY_TRACE_FS_SUBMIT ? "b" : "e", name,
+                (unsigned)ent->aux);
+        break;
+      default:
+        fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"cat\":\"%s\","
+                "\"name\":\"%s\",\"args\":{\"id\":%u,\"info\":%d}}",
+                cats[ent->kind], name, ent->id, (int)ent->aux);
+    }
+  }
+  fprintf(out, "\n]}\n");
+  if (fclose(out)) return -errno;
+  return 0;
+}
+
 /* ========================================================================== */
 /* streams                                                                    */
 /* ========================================================================== */
 void ray_close_cb(uv_handle_t* handle) {
   ray_handle_t* self = container_of(handle, ray_handle_t, u);
+  if (self->pooled) ray_pool_forget(self->pooled);
   ray_evt_t evt = ray_evt_init(self, RAY_CLOSE, 0, NULL);
   ray_queue_post(self->queue, &evt);
 }
 void ray_close(ray_handle_t* self) {
-  if (!uv_is_closing(&self->u.handle)) {
+  if (self->reader) {
+    ray_reader_close(self->reader);
+  }
+  else if (self->log) {
+    ray_log_close(self->log);
+  }
+  else if (self->flags & RAY_HANDLE_MAILBOX) {
+    ray_mailbox_close(self);
+  }
+  else if (!uv_is_closing(&self->u.handle)) {
     uv_close(&self->u.handle, ray_close_cb);
   }
   else {
@@ -152,15 +875,32 @@ void ray_close(ray_handle_t* self) {
   }
 }
 
+/* libuv can't be refused a buffer, past the hard limit the read lands in
+   the queue's spill buffer and ray_read_cb turns it into an error */
 uv_buf_t ray_alloc_cb(uv_handle_t* handle, size_t size) {
-  return uv_buf_init(malloc(1024), 1024);
+  ray_queue_t* queue = container_of(handle, ray_handle_t, u)->queue;
+  char* base = (char*)ray_mem_alloc(queue, RAY_MEM_READ, RAY_READ_SIZE);
+  if (!base) base = queue->spill;
+  return uv_buf_init(base, RAY_READ_SIZE);
 }
 
 void ray_read_cb(uv_stream_t* stream, ssize_t nread, uv_buf_t buf) {
   TRACE("read_cb: nread %i\n", (int)nread);
   ray_handle_t* self = container_of(stream, ray_handle_t, u);
+  if (buf.base == self->queue->spill) {
+    buf.base = NULL;
+    if (nread > 0) nread = UV__ENOMEM;
+  }
+  if (self->pooled && self->pooled->state == RAY_POOL_IDLE) {
+    /* data or EOF on an idle pooled connection, it can't be reused */
+    ray_mem_free(buf.base);
+    if (nread != 0) ray_pool_drop(self->pooled);
+    return;
+  }
+  if (nread > 0 && self->queue->read_budget) ray_throttle(self);
+  if (nread > 0 && ray_mem_tight(self->queue)) ray_mem_pause(self);
   if (nread == 0) {
-    if (buf.base) free(buf.base);
+    ray_mem_free(buf.base);
     return;
   }
 
@@ -173,7 +913,7 @@ void ray_read_cb(uv_stream_t* stream, ssize_t nread, uv_buf_t buf) {
     uv_errno_t err = nread;
     evt = ray_evt_init(self, RAY_ERROR, err, NULL);
     TRACE("ERROR : %s\n", uv_strerror(err));
-    if (buf.base) free(buf.base);
+    ray_mem_free(buf.base);
     uv_read_stop(stream);
     //ray_close(self);
   }
@@ -187,7 +927,6 @@ void ray_write_cb(uv_write_t* req, int status) {
   ray_queue_post(self->queue, &evt);
   ray_msg_t* msg = container_of(req, ray_msg_t, u);
   ray_msg_done(msg);
-  ray_queue_interrupt(self->queue);
 }
 
 int ray_read_start(ray_handle_t* self) {
@@ -195,7 +934,6 @@ int ray_read_start(ray_handle_t* self) {
   if (uv_is_closing(&self->u.handle)) {
     ray_evt_t evt = ray_evt_init(self, RAY_ERROR, UV__EIO, NULL);
     ray_queue_post(self->queue, &evt);
-    ray_queue_interrupt(self->queue);
     return -1;
   }
   int rc = uv_read_start(&self->u.stream, ray_alloc_cb, ray_read_cb);
@@ -203,6 +941,7 @@ int ray_read_start(ray_handle_t* self) {
   return rc;
 }
 int ray_read_stop(ray_handle_t* self) {
+  ray_unthrottle(self);
   return uv_read_stop(&self->u.stream);
 }
 
@@ -213,14 +952,87 @@ int ray_write(ray_handle_t* self, const char* str, size_t len) {
   return uv_write(&msg->u.write, &self->u.stream, &buf, 1, ray_write_cb);
 }
 
+/* the iovecs only need to live until the call returns, the memory they
+   point to must stay valid until RAY_WRITE */
+int ray_writev(ray_handle_t* self, const ray_iov_t* iov, int cnt) {
+  uv_buf_t  bufs_s[16];
+  uv_buf_t* bufs = bufs_s;
+  int i, rc;
+
+  if (cnt > 16) {
+    bufs = (uv_buf_t*)malloc(cnt * sizeof(uv_buf_t));
+    if (!bufs) return UV__ENOMEM;
+  }
+  for (i = 0; i < cnt; i++) {
+    bufs[i] = uv_buf_init(iov[i].base, (unsigned int)iov[i].len);
+  }
+
+  ray_msg_t* msg = ray_msg_next(self->queue);
+  msg->u.req.data = self;
+  rc = uv_write(&msg->u.write, &self->u.stream, bufs, cnt, ray_write_cb);
+
+  if (bufs != bufs_s) free(bufs);
+  return rc;
+}
+
+/* Accepts the pending connection into a pooled handle and returns its id.
+   libuv calls back once per connection and keeps draining the backlog for
+   as long as each one is accepted before we return. */
+int ray_accept_auto(ray_handle_t* self) {
+  ray_queue_t* queue = self->queue;
+  ray_handle_t* client = ray_handle_new(queue, self->u.handle.type);
+  int rc;
+  if (!client) return UV__ENOMEM;
+
+  if (self->u.handle.type == UV_NAMED_PIPE) {
+    rc = uv_pipe_init(queue->loop, &client->u.pipe, 0);
+  }
+  else {
+    rc = uv_tcp_init(queue->loop, &client->u.tcp);
+  }
+  if (rc) {
+    ray_handle_free(client);
+    return rc;
+  }
+
+  rc = uv_accept(&self->u.stream, &client->u.stream);
+  if (!rc && (self->flags & RAY_ACCEPT_READ)) {
+    rc = uv_read_start(&client->u.stream, ray_alloc_cb, ray_read_cb);
+  }
+  if (rc) {
+    uv_close(&client->u.handle, ray_free_cb);
+    return rc;
+  }
+  return client->id;
+}
+
 void ray_connection_cb(uv_stream_t* stream, int status) {
   ray_handle_t* self = container_of(stream, ray_handle_t, u);
-  ray_evt_t evt = ray_evt_init(self, RAY_CONNECTION, status, NULL);
   TRACE("connection_cb on self %p\n", self);
+  if (status == 0 && ray_mem_tight(self->queue)) {
+    /* libuv stops accepting until this one is, ray_queue_resume replays it */
+    self->flags |= RAY_HANDLE_DEFERRED;
+    ray_park(self);
+    self->queue->mem_parked = 1;
+    return;
+  }
+  if (status == 0 && (self->flags & RAY_ACCEPT_AUTO)) {
+    status = ray_accept_auto(self);
+  }
+  ray_evt_t evt = ray_evt_init(self, RAY_CONNECTION, status, NULL);
   ray_queue_post(self->queue, &evt);
 }
 
-int ray_listen(ray_handle_t* self, int backlog) {
+/* With RAY_ACCEPT_AUTO, RAY_CONNECTION carries the id of a client that is
+   already accepted (and reading, with RAY_ACCEPT_READ) and belongs to the
+   consumer, or an error. Handles for a full backlog are reserved up front. */
+int ray_listen(ray_handle_t* self, int backlog, int flags) {
+  /* the state bits above the accept mode stay */
+  self->flags = (self->flags & ~(RAY_ACCEPT_AUTO | RAY_ACCEPT_READ)) | flags;
+  if (flags & RAY_ACCEPT_AUTO) {
+    int rc = ray_handle_reserve(self->queue, self->u.handle.type, backlog);
+    if (rc) return rc;
+  }
   return uv_listen(&self->u.stream, backlog, ray_connection_cb);
 }
 
@@ -235,11 +1047,213 @@ void ray_handle_set_data(ray_handle_t* self, void* data) {
   self->data = data;
 }
 
-int ray_handle_get_id(ray_handle_t* self) {
+uint32_t ray_handle_get_id(ray_handle_t* self) {
   return self->id;
 }
-void ray_handle_set_id(ray_handle_t* self, int id) {
-  self->id = id;
+
+/* ========================================================================== */
+/* read budget                                                                */
+/* ========================================================================== */
+/* restarts reads and replays deferred connections of parked handles */
+void ray_queue_resume(ray_queue_t* self) {
+  ray_handle_t* handle = self->throttled;
+  self->throttled  = NULL;
+  self->mem_parked = 0;
+  while (handle) {
+    ray_handle_t* next = handle->throttle_next;
+    int flags = handle->flags;
+    handle->throttle_next = NULL;
+    handle->flags &= ~(RAY_HANDLE_THROTTLED | RAY_HANDLE_DEFERRED);
+    if (uv_is_closing(&handle->u.handle)) {
+      /* nothing to restart */
+    }
+    else if (flags & RAY_HANDLE_DEFERRED) {
+      ray_connection_cb(&handle->u.stream, 0);
+    }
+    else {
+      uv_read_start(&handle->u.stream, ray_alloc_cb, ray_read_cb);
+    }
+    handle = next;
+  }
+}
+
+/* A new loop turn starts before each poll, handles that used up their
+   budget in the last one read again, unless memory is still tight. */
+void ray_queue_prepare_cb(uv_prepare_t* prepare, int status) {
+  ray_queue_t* self = container_of(prepare, ray_queue_t, prepare);
+  (void)status;
+  self->turn++;
+  if (!ray_mem_tight(self)) ray_queue_resume(self);
+}
+
+/* RAY_READ events a stream may post per loop turn, 0 lifts the limit */
+void ray_queue_set_read_budget(ray_queue_t* self, uint32_t budget) {
+  self->read_budget = budget;
+  if (budget) {
+    uv_prepare_start(&self->prepare, ray_queue_prepare_cb);
+  }
+  else if (!self->mem_soft) {
+    ray_queue_prepare_cb(&self->prepare, 0);
+    uv_prepare_stop(&self->prepare);
+  }
+}
+
+/* how many times handles ran out of budget */
+uint64_t ray_queue_get_throttled(ray_queue_t* self) {
+  return self->nthrottled;
+}
+uint32_t ray_handle_get_throttled(ray_handle_t* self) {
+  return self->nthrottled;
+}
+
+/* counts a read, and parks the handle once it reaches the budget */
+void ray_throttle(ray_handle_t* self) {
+  ray_queue_t* queue = self->queue;
+  if (self->read_turn != queue->turn) {
+    self->read_turn = queue->turn;
+    self->nreads = 0;
+  }
+  if (++self->nreads < queue->read_budget) return;
+  if (self->flags & RAY_HANDLE_THROTTLED) return;
+  uv_read_stop(&self->u.stream);
+  ray_park(self);
+  self->nthrottled++;
+  queue->nthrottled++;
+}
+
+/* puts the handle on the queue's parked list, see ray_queue_resume */
+void ray_park(ray_handle_t* self) {
+  ray_queue_t* queue = self->queue;
+  if (self->flags & RAY_HANDLE_THROTTLED) return;
+  self->flags |= RAY_HANDLE_THROTTLED;
+  self->throttle_next = queue->throttled;
+  queue->throttled = self;
+}
+
+void ray_unthrottle(ray_handle_t* self) {
+  if (!(self->flags & RAY_HANDLE_THROTTLED)) return;
+  ray_handle_t** link = &self->queue->throttled;
+  while (*link != self) link = &(*link)->throttle_next;
+  *link = self->throttle_next;
+  self->throttle_next = NULL;
+  self->flags &= ~(RAY_HANDLE_THROTTLED | RAY_HANDLE_DEFERRED);
+}
+
+/* ========================================================================== */
+/* memory accounting                                                          */
+/* ========================================================================== */
+/* Blocks from ray_mem_alloc carry a header naming their queue and category,
+   so that whoever ends up freeing them needs to know neither. Counters are
+   atomic, batch jobs allocate on the threadpool. */
+#define RAY_MEM_HDR ((sizeof(ray_mem_t) + 15) & ~(size_t)15)
+
+/* `strict` charges are refused past the hard limit */
+int ray_mem_charge(ray_queue_t* queue, int cat, size_t size, int strict) {
+  uint64_t used = __atomic_add_fetch(&queue->mem_used, size, __ATOMIC_RELAXED);
+  if (strict && queue->mem_hard && used > queue->mem_hard) {
+    __atomic_sub_fetch(&queue->mem_used, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&queue->nmem_denied, 1, __ATOMIC_RELAXED);
+    return UV__ENOMEM;
+  }
+  __atomic_add_fetch(&queue->mem[cat], size, __ATOMIC_RELAXED);
+  return 0;
+}
+void ray_mem_uncharge(ray_queue_t* queue, int cat, size_t size) {
+  __atomic_sub_fetch(&queue->mem[cat], size, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&queue->mem_used, size, __ATOMIC_RELAXED);
+}
+
+void* ray_mem_take(ray_queue_t* queue, int cat, size_t size, int strict) {
+  ray_mem_t* hdr;
+  if (ray_mem_charge(queue, cat, size, strict)) return NULL;
+  hdr = (ray_mem_t*)malloc(RAY_MEM_HDR + size);
+  if (!hdr) {
+    ray_mem_uncharge(queue, cat, size);
+    return NULL;
+  }
+  hdr->queue = queue;
+  hdr->size  = size;
+  hdr->cat   = cat;
+  return (char*)hdr + RAY_MEM_HDR;
+}
+
+/* NULL past the queue's hard limit */
+void* ray_mem_alloc(ray_queue_t* queue, int cat, size_t size) {
+  return ray_mem_take(queue, cat, size, 1);
+}
+
+void* ray_mem_realloc(ray_queue_t* queue, int cat, void* ptr, size_t size) {
+  ray_mem_t* hdr;
+  if (!ptr) return ray_mem_alloc(queue, cat, size);
+  hdr = (ray_mem_t*)((char*)ptr - RAY_MEM_HDR);
+  if (size > hdr->size && ray_mem_charge(queue, cat, size - hdr->size, 1)) {
+    return NULL;
+  }
+  ray_mem_t* grown = (ray_mem_t*)realloc(hdr, RAY_MEM_HDR + size);
+  if (!grown) {
+    if (size > hdr->size) ray_mem_uncharge(queue, cat, size - hdr->size);
+    return NULL;
+  }
+  if (size < grown->size) ray_mem_uncharge(queue, cat, grown->size - size);
+  grown->size = size;
+  return (char*)grown + RAY_MEM_HDR;
+}
+
+char* ray_mem_strdup(ray_queue_t* queue, int cat, const char* str) {
+  size_t len = strlen(str) + 1;
+  char* copy = (char*)ray_mem_alloc(queue, cat, len);
+  if (copy) memcpy(copy, str, len);
+  return copy;
+}
+
+void ray_mem_free(void* ptr) {
+  ray_mem_t* hdr;
+  if (!ptr) return;
+  hdr = (ray_mem_t*)((char*)ptr - RAY_MEM_HDR);
+  ray_mem_uncharge(hdr->queue, hdr->cat, hdr->size);
+  free(hdr);
+}
+
+/* past the soft limit */
+int ray_mem_tight(ray_queue_t* queue) {
+  return queue->mem_soft &&
+    __atomic_load_n(&queue->mem_used, __ATOMIC_RELAXED) >= queue->mem_soft;
+}
+
+/* stops reading until usage is back under the soft limit */
+void ray_mem_pause(ray_handle_t* self) {
+  if (self->flags & RAY_HANDLE_THROTTLED) return;
+  uv_read_stop(&self->u.stream);
+  ray_park(self);
+  self->queue->mem_parked = 1;
+}
+
+/* Bytes in use past `soft` pause reads and defer accepts until the consumer
+   has released enough events, past `hard` allocations fail and the events
+   that needed them become errors. 0 disables either. */
+void ray_queue_set_mem_limits(ray_queue_t* self, uint64_t soft, uint64_t hard) {
+  self->mem_soft = soft;
+  self->mem_hard = hard;
+  if (soft) {
+    uv_prepare_start(&self->prepare, ray_queue_prepare_cb);
+  }
+  else if (!self->read_budget) {
+    uv_prepare_stop(&self->prepare);
+  }
+  if (self->mem_parked && !ray_mem_tight(self)) ray_queue_resume(self);
+}
+
+/* bytes in use for `cat`, or in total for RAY_MEM_MAX */
+uint64_t ray_queue_mem_used(ray_queue_t* self, int cat) {
+  if (cat < 0 || cat >= RAY_MEM_MAX) {
+    return __atomic_load_n(&self->mem_used, __ATOMIC_RELAXED);
+  }
+  return __atomic_load_n(&self->mem[cat], __ATOMIC_RELAXED);
+}
+
+/* allocations refused at the hard limit */
+uint64_t ray_queue_mem_denied(ray_queue_t* self) {
+  return __atomic_load_n(&self->nmem_denied, __ATOMIC_RELAXED);
 }
 
 /* ========================================================================== */
@@ -252,8 +1266,12 @@ void ray_timer_cb(uv_timer_t* timer, int status) {
 }
 
 ray_handle_t* ray_timer_new(ray_queue_t* queue) {
-  ray_handle_t* self = ray_handle_new(queue);
-  if (uv_timer_init(queue->loop, &self->u.timer)) return NULL;
+  ray_handle_t* self = ray_handle_new(queue, UV_TIMER);
+  if (!self) return NULL;
+  if (uv_timer_init(queue->loop, &self->u.timer)) {
+    ray_handle_free(self);
+    return NULL;
+  }
   return self;
 }
 
@@ -271,39 +1289,957 @@ int ray_tcp_init(ray_handle_t* self) {
   return uv_tcp_init(self->queue->loop, &self->u.tcp);
 }
 ray_handle_t* ray_tcp_new(ray_queue_t* queue) {
-  ray_handle_t* self = ray_handle_new(queue);
-  if (ray_tcp_init(self)) return NULL;
+  ray_handle_t* self = ray_handle_new(queue, UV_TCP);
+  if (!self) return NULL;
+  if (ray_tcp_init(self)) {
+    ray_handle_free(self);
+    return NULL;
+  }
   return self;
 }
 
 int ray_tcp_bind(ray_handle_t* self, const char* host, int port) {
+  if (strchr(host, ':')) {
+    struct sockaddr_in6 addr6 = uv_ip6_addr(host, port);
+    return uv_tcp_bind6(&self->u.tcp, addr6);
+  }
   struct sockaddr_in addr;
   addr = uv_ip4_addr(host, port);
   return uv_tcp_bind(&self->u.tcp, addr);
 }
 
+/* pooled connections report to the pool instead */
+void ray_connect_done(ray_handle_t* self, int status) {
+  if (self->pooled) {
+    ray_pool_connected(self->pooled, status);
+    return;
+  }
+  ray_evt_t evt = ray_evt_init(self, RAY_CONNECT, status, NULL);
+  ray_queue_post(self->queue, &evt);
+}
+
+void ray_connect_cb(uv_connect_t* req, int status) {
+  ray_connect_done((ray_handle_t*)req->data, status);
+  ray_msg_done(container_of(req, ray_msg_t, u));
+}
+
+int ray_tcp_connect_addr(ray_handle_t* self, const struct sockaddr* addr, int port) {
+  ray_msg_t* msg = ray_msg_next(self->queue);
+  int rc;
+  msg->u.req.data = self;
+  if (addr->sa_family == AF_INET6) {
+    struct sockaddr_in6 addr6 = *(const struct sockaddr_in6*)addr;
+    addr6.sin6_port = htons((unsigned short)port);
+    rc = uv_tcp_connect6(&msg->u.connect, &self->u.tcp, addr6, ray_connect_cb);
+  }
+  else {
+    struct sockaddr_in addr4 = *(const struct sockaddr_in*)addr;
+    addr4.sin_port = htons((unsigned short)port);
+    rc = uv_tcp_connect(&msg->u.connect, &self->u.tcp, addr4, ray_connect_cb);
+  }
+  if (rc) ray_msg_done(msg);
+  return rc;
+}
+
 /* ========================================================================== */
-/* idle                                                                       */
+/* name resolution                                                            */
 /* ========================================================================== */
-void ray_idle_cb(uv_idle_t* idle, int status) {
-  ray_handle_t* self = container_of(idle, ray_handle_t, u);
-  ray_evt_t evt = ray_evt_init(self, RAY_IDLE, status, NULL);
-  ray_queue_post(self->queue, &evt);
+#define RAY_DNS_TTL      60000
+#define RAY_DNS_NEG_TTL  5000
+
+uint32_t ray_str_hash(const char* str) {
+  uint32_t h = 2166136261u;
+  while (*str) {
+    h ^= (uint8_t)*str++;
+    h *= 16777619u;
+  }
+  return h;
 }
 
-ray_handle_t* ray_idle_new(ray_queue_t* queue) {
-  ray_handle_t* self = ray_handle_new(queue);
-  uv_idle_init(self->queue->loop, &self->u.idle);
+ray_dns_t* ray_dns_new(ray_queue_t* queue) {
+  ray_dns_t* self = (ray_dns_t*)calloc(1, sizeof(ray_dns_t));
+  self->queue   = queue;
+  self->ttl     = RAY_DNS_TTL;
+  self->neg_ttl = RAY_DNS_NEG_TTL;
   return self;
 }
-int ray_idle_start(ray_handle_t* self) {
-  return uv_idle_start(&self->u.idle, ray_idle_cb);
+
+/* how long, in ms, names and failed lookups are remembered */
+void ray_queue_set_dns_ttl(ray_queue_t* queue, uint64_t ttl, uint64_t neg_ttl) {
+  if (!queue->dns) queue->dns = ray_dns_new(queue);
+  queue->dns->ttl     = ttl;
+  queue->dns->neg_ttl = neg_ttl;
 }
-int ray_idle_stop(ray_handle_t* self) {
-  return uv_idle_stop(&self->u.idle);
+
+void ray_dns_ent_free(ray_dns_ent_t* ent) {
+  while (ent->whead) {
+    ray_dns_wait_t* w = ent->whead;
+    ent->whead = w->next;
+    free(w);
+  }
+  free(ent->host);
+  free(ent);
+}
+
+/* lookups still running are orphaned, ray_dns_cb frees them */
+void ray_dns_free(ray_dns_t* self) {
+  int i;
+  for (i = 0; i < RAY_DNS_BUCKETS; i++) {
+    while (self->buckets[i]) {
+      ray_dns_ent_t* ent = self->buckets[i];
+      self->buckets[i] = ent->hnext;
+      if (ent->state == RAY_DNS_PENDING) ent->dns = NULL;
+      else ray_dns_ent_free(ent);
+    }
+  }
+  free(self);
 }
 
-/* ========================================================================== */
+/* literal addresses never reach the resolver */
+int ray_dns_literal(const char* host, struct sockaddr_storage* addr) {
+  memset(addr, 0, sizeof(*addr));
+#ifndef _WIN32
+  struct sockaddr_in*  addr4 = (struct sockaddr_in*)addr;
+  struct sockaddr_in6* addr6 = (struct sockaddr_in6*)addr;
+  if (inet_pton(AF_INET, host, &addr4->sin_addr) == 1) {
+    addr4->sin_family = AF_INET;
+    return 0;
+  }
+  if (inet_pton(AF_INET6, host, &addr6->sin6_addr) == 1) {
+    addr6->sin6_family = AF_INET6;
+    return 0;
+  }
+#endif
+  return UV__EINVAL;
+}
+
+ray_dns_ent_t* ray_dns_find(ray_dns_t* self, const char* host, uint32_t hash) {
+  ray_dns_ent_t* ent = self->buckets[hash % RAY_DNS_BUCKETS];
+  while (ent) {
+    if (ent->hash == hash && strcmp(ent->host, host) == 0) return ent;
+    ent = ent->hnext;
+  }
+  return NULL;
+}
+
+/* drops expired entries, which nobody waits on, from the bucket of `hash` */
+void ray_dns_sweep(ray_dns_t* self, uint32_t hash, uint64_t now) {
+  ray_dns_ent_t** link = &self->buckets[hash % RAY_DNS_BUCKETS];
+  while (*link) {
+    ray_dns_ent_t* ent = *link;
+    if (ent->state != RAY_DNS_PENDING && now >= ent->expires) {
+      *link = ent->hnext;
+      ray_dns_ent_free(ent);
+    }
+    else {
+      link = &ent->hnext;
+    }
+  }
+}
+
+int ray_dns_connect(ray_dns_ent_t* ent, ray_handle_t* handle, int port) {
+  struct sockaddr* addr =
+    (struct sockaddr*)&ent->addrs[ent->next_addr++ % ent->naddrs];
+  return ray_tcp_connect_addr(handle, addr, port);
+}
+
+void ray_dns_cb(uv_getaddrinfo_t* req, int status, struct addrinfo* res) {
+  ray_dns_ent_t* ent = container_of(req, ray_dns_ent_t, req);
+  ray_dns_t* self = ent->dns;
+  struct addrinfo* ai;
+
+  if (!self) {
+    if (res) uv_freeaddrinfo(res);
+    ray_dns_ent_free(ent);
+    return;
+  }
+  ray_queue_t* queue = self->queue;
+
+  ent->naddrs = 0;
+  for (ai = res; ai && ent->naddrs < RAY_DNS_MAX_ADDRS; ai = ai->ai_next) {
+    if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) continue;
+    memcpy(&ent->addrs[ent->naddrs++], ai->ai_addr, ai->ai_addrlen);
+  }
+  if (res) uv_freeaddrinfo(res);
+  if (status == 0 && ent->naddrs == 0) status = UV__EAI_NONAME;
+
+  ent->err     = status;
+  ent->state   = status ? RAY_DNS_FAILED : RAY_DNS_READY;
+  ent->expires = uv_now(queue->loop) + (status ? self->neg_ttl : self->ttl);
+
+  /* every connect that piled up behind this lookup goes now */
+  ray_dns_wait_t* w = ent->whead;
+  ent->whead = ent->wtail = NULL;
+  while (w) {
+    ray_dns_wait_t* next = w->next;
+    ray_handle_t* handle = ray_handle_get(queue, w->id);
+    if (handle) {
+      int rc = status ? status : ray_dns_connect(ent, handle, w->port);
+      if (rc) ray_connect_done(handle, rc);
+    }
+    free(w);
+    w = next;
+  }
+}
+
+int ray_dns_resolve(ray_dns_t* self, ray_dns_ent_t* ent) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags    = AI_ADDRCONFIG;
+  ent->state = RAY_DNS_PENDING;
+  return uv_getaddrinfo(
+    self->queue->loop, &ent->req, ray_dns_cb, ent->host, NULL, &hints
+  );
+}
+
+/* Connects to `host`, which is resolved through the queue's cache unless it
+   is an address literal. Connects to a name that is being looked up wait on
+   that lookup rather than starting another. RAY_CONNECT follows with the
+   status, unless this returns an error. */
+int ray_tcp_connect(ray_handle_t* self, const char* host, int port) {
+  ray_queue_t* queue = self->queue;
+  struct sockaddr_storage addr;
+  int rc;
+
+  if (ray_dns_literal(host, &addr) == 0) {
+    return ray_tcp_connect_addr(self, (struct sockaddr*)&addr, port);
+  }
+
+  if (!queue->dns) queue->dns = ray_dns_new(queue);
+  ray_dns_t* dns = queue->dns;
+  uint32_t hash = ray_str_hash(host);
+  uint64_t now  = uv_now(queue->loop);
+  ray_dns_ent_t* ent = ray_dns_find(dns, host, hash);
+
+  if (!ent) {
+    ray_dns_sweep(dns, hash, now);
+    ent = (ray_dns_ent_t*)calloc(1, sizeof(ray_dns_ent_t));
+    ent->host = strdup(host);
+    ent->hash = hash;
+    ent->dns  = dns;
+    if ((rc = ray_dns_resolve(dns, ent))) {
+      ray_dns_ent_free(ent);
+      return rc;
+    }
+    ent->hnext = dns->buckets[hash % RAY_DNS_BUCKETS];
+    dns->buckets[hash % RAY_DNS_BUCKETS] = ent;
+  }
+  else if (ent->state != RAY_DNS_PENDING && now >= ent->expires) {
+    if ((rc = ray_dns_resolve(dns, ent))) {
+      ent->state   = RAY_DNS_FAILED;
+      ent->err     = rc;
+      ent->expires = now + dns->neg_ttl;
+      return rc;
+    }
+  }
+
+  switch (ent->state) {
+    case RAY_DNS_READY: {
+      return ray_dns_connect(ent, self, port);
+    }
+    case RAY_DNS_FAILED: {
+      return ent->err;
+    }
+    default: {
+      ray_dns_wait_t* w = (ray_dns_wait_t*)malloc(sizeof(ray_dns_wait_t));
+      if (!w) return UV__ENOMEM;
+      w->id   = self->id;
+      w->port = port;
+      w->next = NULL;
+      if (ent->wtail) ent->wtail->next = w;
+      else ent->whead = w;
+      ent->wtail = w;
+      return 0;
+    }
+  }
+}
+
+/* ========================================================================== */
+/* connection pool                                                            */
+/* ========================================================================== */
+#define RAY_POOL_MAX_CONNS  64
+#define RAY_POOL_IDLE_TTL   30000
+
+/* evicts connections idle for longer than the ttl, oldest first */
+void ray_pool_timer_cb(uv_timer_t* timer, int status) {
+  ray_pool_t* self = container_of(timer, ray_pool_t, timer);
+  uint64_t now = uv_now(self->queue->loop);
+  int i;
+  (void)status;
+  for (i = 0; i < RAY_POOL_BUCKETS; i++) {
+    ray_pool_dest_t* dest;
+    for (dest = self->buckets[i]; dest; dest = dest->hnext) {
+      while (dest->idle_tail &&
+             now - dest->idle_tail->idle_since >= self->idle_ttl) {
+        self->stats.evictions++;
+        ray_pool_drop(dest->idle_tail);
+      }
+    }
+  }
+}
+
+void ray_pool_arm(ray_pool_t* self) {
+  uint64_t every = self->idle_ttl / 2;
+  if (every < 100) every = 100;
+  uv_timer_start(&self->timer, ray_pool_timer_cb, every, every);
+}
+
+ray_pool_t* ray_pool_get(ray_queue_t* queue) {
+  if (!queue->pool) {
+    ray_pool_t* self = (ray_pool_t*)calloc(1, sizeof(ray_pool_t));
+    self->queue     = queue;
+    self->max_conns = RAY_POOL_MAX_CONNS;
+    self->idle_ttl  = RAY_POOL_IDLE_TTL;
+    uv_timer_init(queue->loop, &self->timer);
+    uv_unref((uv_handle_t*)&self->timer);
+    ray_pool_arm(self);
+    queue->pool = self;
+  }
+  return queue->pool;
+}
+
+/* connections per destination and how long, in ms, idle ones are kept */
+int ray_pool_config(ray_queue_t* queue, int max_conns, uint64_t idle_ttl) {
+  if (max_conns <= 0) return UV__EINVAL;
+  ray_pool_t* self = ray_pool_get(queue);
+  self->max_conns = max_conns;
+  self->idle_ttl  = idle_ttl;
+  ray_pool_arm(self);
+  return 0;
+}
+
+void ray_pool_stats(ray_queue_t* queue, ray_pool_stats_t* stats) {
+  if (queue->pool) *stats = queue->pool->stats;
+  else memset(stats, 0, sizeof(*stats));
+}
+
+ray_pool_dest_t* ray_pool_dest(ray_pool_t* self, const char* host, int port) {
+  uint32_t hash = ray_str_hash(host) ^ (uint32_t)port;
+  ray_pool_dest_t** slot = &self->buckets[hash % RAY_POOL_BUCKETS];
+  ray_pool_dest_t* dest;
+  for (dest = *slot; dest; dest = dest->hnext) {
+    if (dest->hash == hash && dest->port == port && !strcmp(dest->host, host)) {
+      return dest;
+    }
+  }
+  dest = (ray_pool_dest_t*)calloc(1, sizeof(ray_pool_dest_t));
+  dest->pool  = self;
+  dest->host  = strdup(host);
+  dest->port  = port;
+  dest->hash  = hash;
+  dest->hnext = *slot;
+  *slot = dest;
+  return dest;
+}
+
+void ray_pool_idle_unlink(ray_pool_dest_t* dest, ray_pool_conn_t* conn) {
+  if (conn->prev) conn->prev->next = conn->next;
+  else dest->idle = conn->next;
+  if (conn->next) conn->next->prev = conn->prev;
+  else dest->idle_tail = conn->prev;
+  conn->prev = conn->next = NULL;
+}
+
+void ray_pool_post(ray_pool_t* self, ray_handle_t* handle, int ticket, int status, uint64_t since) {
+  uint64_t wait = uv_hrtime() - since;
+  /* leases are bounded by the pool, charged but never refused */
+  ray_lease_t* lease = (ray_lease_t*)ray_mem_take(self->queue, RAY_MEM_OTHER, sizeof(ray_lease_t), 0);
+  lease->ticket  = ticket;
+  lease->status  = status;
+  lease->wait_ns = wait;
+  if (status == 0) {
+    self->stats.wait_ns += wait;
+    if (wait > self->stats.max_wait_ns) self->stats.max_wait_ns = wait;
+  }
+  ray_evt_t evt = ray_evt_init(handle, RAY_CONNECT, status, lease);
+  ray_queue_post(self->queue, &evt);
+}
+
+/* hands a connected handle to `ticket`, which then owns it until release */
+void ray_pool_grant(ray_pool_conn_t* conn, int ticket, uint64_t since) {
+  conn->state = RAY_POOL_BUSY;
+  ray_read_stop(conn->handle);
+  ray_pool_post(conn->dest->pool, conn->handle, ticket, 0, since);
+}
+
+int ray_pool_connect(ray_pool_dest_t* dest, int ticket, uint64_t since) {
+  ray_pool_t* self = dest->pool;
+  ray_handle_t* handle = ray_tcp_new(self->queue);
+  if (!handle) return UV__ENOMEM;
+
+  ray_pool_conn_t* conn = (ray_pool_conn_t*)calloc(1, sizeof(ray_pool_conn_t));
+  conn->handle = handle;
+  conn->dest   = dest;
+  conn->state  = RAY_POOL_CONNECTING;
+  conn->ticket = ticket;
+  conn->since  = since;
+  handle->pooled = conn;
+  dest->nconns++;
+  self->stats.connects++;
+
+  int rc = ray_tcp_connect(handle, dest->host, dest->port);
+  if (rc) {
+    dest->nconns--;
+    handle->pooled = NULL;
+    free(conn);
+    uv_close(&handle->u.handle, ray_free_cb);
+  }
+  return rc;
+}
+
+/* opens connections for queued acquires while there is room under the cap */
+void ray_pool_serve(ray_pool_dest_t* dest) {
+  ray_pool_t* self = dest->pool;
+  while (dest->whead && dest->nconns < self->max_conns) {
+    ray_pool_wait_t* w = dest->whead;
+    dest->whead = w->next;
+    if (!dest->whead) dest->wtail = NULL;
+    int rc = ray_pool_connect(dest, w->ticket, w->since);
+    if (rc) ray_pool_post(self, NULL, w->ticket, rc, w->since);
+    free(w);
+  }
+}
+
+/* Returns a ticket, RAY_CONNECT answers it with a ray_lease_t as data. On
+   success the event is for the granted handle, reused or freshly connected,
+   otherwise it has no handle and info is the error. */
+int ray_pool_acquire(ray_queue_t* queue, const char* host, int port) {
+  ray_pool_t* self = ray_pool_get(queue);
+  ray_pool_dest_t* dest = ray_pool_dest(self, host, port);
+  uint64_t now = uv_hrtime();
+  int rc;
+
+  if (++self->next_ticket <= 0) self->next_ticket = 1;
+  int ticket = self->next_ticket;
+  self->stats.acquires++;
+
+  if (dest->idle) {
+    ray_pool_conn_t* conn = dest->idle;
+    ray_pool_idle_unlink(dest, conn);
+    self->stats.reuses++;
+    ray_pool_grant(conn, ticket, now);
+    return ticket;
+  }
+
+  if (dest->nconns < self->max_conns) {
+    if ((rc = ray_pool_connect(dest, ticket, now))) return rc;
+    return ticket;
+  }
+
+  ray_pool_wait_t* w = (ray_pool_wait_t*)malloc(sizeof(ray_pool_wait_t));
+  if (!w) return UV__ENOMEM;
+  w->ticket = ticket;
+  w->since  = now;
+  w->next   = NULL;
+  if (dest->wtail) dest->wtail->next = w;
+  else dest->whead = w;
+  dest->wtail = w;
+  self->stats.waits++;
+  return ticket;
+}
+
+void ray_pool_connected(ray_pool_conn_t* conn, int status) {
+  if (status == 0) {
+    ray_pool_grant(conn, conn->ticket, conn->since);
+  }
+  else {
+    ray_pool_post(conn->dest->pool, NULL, conn->ticket, status, conn->since);
+    ray_pool_drop(conn);
+  }
+}
+
+/* the connection is gone, its slot goes to whoever waits for one */
+void ray_pool_forget(ray_pool_conn_t* conn) {
+  ray_pool_dest_t* dest = conn->dest;
+  if (conn->state == RAY_POOL_IDLE) ray_pool_idle_unlink(dest, conn);
+  conn->handle->pooled = NULL;
+  dest->nconns--;
+  free(conn);
+  ray_pool_serve(dest);
+}
+
+/* closes the connection without a RAY_CLOSE, the handle is freed */
+void ray_pool_drop(ray_pool_conn_t* conn) {
+  ray_handle_t* handle = conn->handle;
+  ray_pool_forget(conn);
+  if (!uv_is_closing(&handle->u.handle)) {
+    uv_close(&handle->u.handle, ray_free_cb);
+  }
+}
+
+/* Marks reads of the ending lease the consumer hasn't taken yet to be
+   dropped, returns 1 if one of them is an error. */
+int ray_pool_forsake(ray_handle_t* handle) {
+  ray_queue_t* queue = handle->queue;
+  int i, err = 0;
+  for (i = 0; i < RAY_LANE_MAX; i++) {
+    ray_lane_t* lane = &queue->lanes[i];
+    size_t n;
+    for (n = lane->nget; n != lane->nput; n++) {
+      ray_evt_t* evt = &lane->evts[n % lane->size];
+      if (evt->id != handle->id) continue;
+      if (evt->type == RAY_READ || evt->type == RAY_ERROR) handle->nstale++;
+      if (evt->type == RAY_ERROR) err = 1;
+    }
+  }
+  return err;
+}
+
+/* Gives a granted connection back. It goes to the oldest queued acquire or
+   is kept reading while idle, so a peer closing it or sending anything
+   unasked for gets it dropped before it is handed out again. */
+int ray_pool_release(ray_handle_t* handle) {
+  ray_pool_conn_t* conn = handle->pooled;
+  if (!conn || conn->state != RAY_POOL_BUSY) return UV__EINVAL;
+  ray_pool_dest_t* dest = conn->dest;
+
+  /* the peer already ended it, nothing to give back */
+  if (ray_pool_forsake(handle)) {
+    ray_pool_drop(conn);
+    return 0;
+  }
+
+  if (dest->whead) {
+    ray_pool_wait_t* w = dest->whead;
+    dest->whead = w->next;
+    if (!dest->whead) dest->wtail = NULL;
+    ray_pool_grant(conn, w->ticket, w->since);
+    free(w);
+    return 0;
+  }
+
+  if (uv_read_start(&handle->u.stream, ray_alloc_cb, ray_read_cb)) {
+    ray_pool_drop(conn);
+    return 0;
+  }
+  conn->state = RAY_POOL_IDLE;
+  conn->idle_since = uv_now(handle->queue->loop);
+  conn->prev = NULL;
+  conn->next = dest->idle;
+  if (dest->idle) dest->idle->prev = conn;
+  else dest->idle_tail = conn;
+  dest->idle = conn;
+  return 0;
+}
+
+/* for connections that can't be reused, e.g. after a protocol error */
+int ray_pool_discard(ray_handle_t* handle) {
+  ray_pool_conn_t* conn = handle->pooled;
+  if (!conn || conn->state != RAY_POOL_BUSY) return UV__EINVAL;
+  ray_pool_drop(conn);
+  return 0;
+}
+
+void ray_pool_timer_close_cb(uv_handle_t* timer) {
+  free(container_of(timer, ray_pool_t, timer));
+}
+
+/* Leased connections become plain handles of their holders, idle ones and
+   those still connecting are closed. Acquires not yet granted are answered
+   with UV__ECANCELED. With `now` set the loop won't run again and the pool
+   goes at once, otherwise it goes when its timer has closed. */
+void ray_pool_free(ray_pool_t* self, int now) {
+  ray_htable_t* handles = &self->queue->handles;
+  uint32_t i;
+  int j;
+  for (i = 1; i < handles->used; i++) {
+    ray_handle_t* handle = handles->slots[i].handle;
+    if (!handle || !handle->pooled) continue;
+    ray_pool_conn_t* conn = handle->pooled;
+    handle->pooled = NULL;
+    if (conn->state == RAY_POOL_CONNECTING) {
+      ray_pool_post(self, NULL, conn->ticket, UV__ECANCELED, conn->since);
+    }
+    if (conn->state != RAY_POOL_BUSY && !uv_is_closing(&handle->u.handle)) {
+      uv_close(&handle->u.handle, ray_free_cb);
+    }
+    free(conn);
+  }
+  for (j = 0; j < RAY_POOL_BUCKETS; j++) {
+    while (self->buckets[j]) {
+      ray_pool_dest_t* dest = self->buckets[j];
+      self->buckets[j] = dest->hnext;
+      while (dest->whead) {
+        ray_pool_wait_t* w = dest->whead;
+        dest->whead = w->next;
+        ray_pool_post(self, NULL, w->ticket, UV__ECANCELED, w->since);
+        free(w);
+      }
+      free(dest->host);
+      free(dest);
+    }
+  }
+  self->queue->pool = NULL;
+  uv_timer_stop(&self->timer);
+  if (now) free(self);
+  else uv_close((uv_handle_t*)&self->timer, ray_pool_timer_close_cb);
+}
+
+/* the pool starts over on the next acquire or config */
+void ray_pool_close(ray_queue_t* queue) {
+  if (queue->pool) ray_pool_free(queue->pool, 0);
+}
+
+/* ========================================================================== */
+/* messages                                                                   */
+/* ========================================================================== */
+ray_mail_t* ray_mail_new(size_t size) {
+  ray_mail_t* self = (ray_mail_t*)calloc(1, sizeof(ray_mail_t));
+  if (!self) return NULL;
+  ray_buf_init(&self->buf, NULL, size ? size : 64);
+  return self;
+}
+void ray_mail_free(ray_mail_t* self) {
+  if (self->queue) ray_mem_uncharge(self->queue, RAY_MEM_MAIL, self->charged);
+  free(self->buf.base);
+  free(self);
+}
+
+/* moves waiting messages into the event ring while there is room */
+void ray_mail_pump(ray_queue_t* queue) {
+  ray_lane_t* lane = &queue->lanes[ray_lane_of(RAY_MESSAGE)];
+  while (queue->mail_head && lane->nput - lane->nget < lane->size - 1) {
+    ray_mail_t* mail = queue->mail_head;
+    queue->mail_head = mail->next;
+    if (!queue->mail_head) queue->mail_tail = NULL;
+    mail->next = NULL;
+
+    ray_evt_t evt = ray_evt_init(NULL, RAY_MESSAGE, (int)mail->len, mail);
+    evt.id = mail->to;
+    ray_queue_post(queue, &evt);
+  }
+}
+
+void ray_link_put(ray_link_t* self, ray_addr_t from, ray_addr_t to,
+                  const uint8_t* data, size_t len);
+
+/* On the owner thread, mail for a proxy goes on over its link. Mail moves
+   between threads and may outlive its sender's queue, so it is charged to
+   the queue that receives it; past that queue's hard limit it is dropped. */
+void ray_mail_deliver(ray_queue_t* queue, ray_mail_t* mail) {
+  ray_handle_t* target = ray_handle_get(queue, mail->to);
+  if (target && target->proxy) {
+    ray_proxy_t* proxy = target->proxy;
+    ray_link_put(proxy->link, mail->from, proxy->remote, mail->buf.base, mail->len);
+    ray_mail_free(mail);
+    return;
+  }
+  size_t size = sizeof(ray_mail_t) + mail->buf.size;
+  if (ray_mem_charge(queue, RAY_MEM_MAIL, size, 1)) {
+    ray_mail_free(mail);
+    return;
+  }
+  mail->queue   = queue;
+  mail->charged = size;
+  mail->next = NULL;
+  if (queue->mail_tail) queue->mail_tail->next = mail;
+  else queue->mail_head = mail;
+  queue->mail_tail = mail;
+  ray_mail_pump(queue);
+}
+
+/* takes everything other threads pushed, oldest first */
+void ray_mail_drain(ray_queue_t* queue) {
+  ray_mail_t* mail = __atomic_exchange_n(&queue->inbox, NULL, __ATOMIC_ACQUIRE);
+  ray_mail_t* list = NULL;
+  while (mail) {
+    ray_mail_t* next = mail->next;
+    mail->next = list;
+    list = mail;
+    mail = next;
+  }
+  while (list) {
+    ray_mail_t* next = list->next;
+    ray_mail_deliver(queue, list);
+    list = next;
+  }
+}
+
+/* Lock-free push from any thread. Only the push that finds the inbox empty
+   signals the owner, so a burst of sends costs one wakeup. */
+void ray_mail_push(ray_queue_t* queue, ray_mail_t* mail) {
+  ray_mail_t* head = __atomic_load_n(&queue->inbox, __ATOMIC_RELAXED);
+  do {
+    mail->next = head;
+  } while (!__atomic_compare_exchange_n(&queue->inbox, &head, mail, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (!head) uv_async_send(&queue->async);
+}
+
+/* Sends `mail` to the mailbox at `to`, on this thread, another thread or
+   over a link, see ray_link_send. The mail is the receiver's from here on,
+   even when this fails. `from` may be NULL. */
+int ray_mail_send(ray_handle_t* from, ray_addr_t to, ray_mail_t* mail) {
+  mail->len      = ray_buf_get_offset(&mail->buf);
+  mail->buf.head = mail->buf.base;
+  mail->from     = from ? ray_mailbox_addr(from) : 0;
+  return ray_mail_route(to, mail);
+}
+
+/* Hands a mail that is ready to be read to the queue owning `to`. Every
+   send, local or from a link, comes through here and so does the size cap
+   a link puts on its frames. */
+int ray_mail_route(ray_addr_t to, ray_mail_t* mail) {
+  uint32_t qid = (uint32_t)(to >> 32);
+  if (mail->len > RAY_MAIL_MAX) {
+    ray_mail_free(mail);
+    return UV__EINVAL;
+  }
+  ray_queue_t* queue = ray_queue_acquire(qid);
+  if (!queue) {
+    ray_mail_free(mail);
+    return UV__EINVAL;
+  }
+  mail->to = (uint32_t)to;
+  if (uv_thread_self() == __atomic_load_n(&queue->owner, __ATOMIC_ACQUIRE)) {
+    ray_mail_deliver(queue, mail);
+  }
+  else {
+    ray_mail_push(queue, mail);
+  }
+  ray_queue_release(qid);
+  return 0;
+}
+
+/* The async keeps the loop alive while the queue has mailboxes, so that a
+   thread with nothing else to do waits for messages. */
+ray_handle_t* ray_mailbox_new(ray_queue_t* queue) {
+  ray_handle_t* self = ray_handle_new(queue, UV_FILE);
+  if (!self) return NULL;
+  self->flags |= RAY_HANDLE_MAILBOX;
+  if (queue->nmailboxes++ == 0) uv_ref((uv_handle_t*)&queue->async);
+  return self;
+}
+ray_addr_t ray_mailbox_addr(ray_handle_t* self) {
+  return ((ray_addr_t)self->queue->qid << 32) | self->id;
+}
+
+/* messages still on their way are dropped along with the handle */
+void ray_mailbox_close(ray_handle_t* self) {
+  ray_queue_t* queue = self->queue;
+  if (self->flags & RAY_HANDLE_CLOSING) return;
+  self->flags |= RAY_HANDLE_CLOSING;
+  if (--queue->nmailboxes == 0) uv_unref((uv_handle_t*)&queue->async);
+  ray_evt_t evt = ray_evt_init(self, RAY_CLOSE, 0, NULL);
+  ray_queue_post(queue, &evt);
+}
+
+void ray_link_write_cb(uv_write_t* req, int status);
+
+void ray_link_flush(ray_link_t* self) {
+  ray_buf_t tmp = self->wbuf;
+  self->wbuf = self->obuf;
+  self->obuf = tmp;
+  self->obuf.head = self->obuf.base;
+
+  uv_buf_t buf = uv_buf_init((char*)self->wbuf.base,
+                             (unsigned int)ray_buf_get_offset(&self->wbuf));
+  int rc = uv_write(&self->req, &self->handle->u.stream, &buf, 1, ray_link_write_cb);
+  if (rc) {
+    ray_evt_t evt = ray_evt_init(self->handle, RAY_ERROR, rc, NULL);
+    ray_queue_post(self->handle->queue, &evt);
+    return;
+  }
+  self->writing = 1;
+}
+
+void ray_link_write_cb(uv_write_t* req, int status) {
+  ray_link_t* self = container_of(req, ray_link_t, req);
+  self->writing = 0;
+  if (status) {
+    ray_evt_t evt = ray_evt_init(self->handle, RAY_ERROR, status, NULL);
+    ray_queue_post(self->handle->queue, &evt);
+    return;
+  }
+  if (ray_buf_get_offset(&self->obuf)) ray_link_flush(self);
+}
+
+void ray_link_put(ray_link_t* self, ray_addr_t from, ray_addr_t to,
+                  const uint8_t* data, size_t len) {
+  ray_buf_put_uleb128(&self->obuf, (uint32_t)len);
+  ray_buf_put_uint64(&self->obuf, to);
+  ray_buf_put_uint64(&self->obuf, from);
+  ray_buf_write(&self->obuf, (uint8_t*)data, len);
+  if (!self->writing) ray_link_flush(self);
+}
+
+/* Frames `mail` for mailbox `to` on the other side, the mail is consumed.
+   `from` may be NULL, otherwise replies to the message find their way back
+   over the link. */
+int ray_link_send(ray_handle_t* self, ray_handle_t* from, ray_addr_t to, ray_mail_t* mail) {
+  ray_link_t* link = self->link;
+  size_t len = ray_buf_get_offset(&mail->buf);
+  if (!link || len > RAY_MAIL_MAX) {
+    ray_mail_free(mail);
+    return UV__EINVAL;
+  }
+  ray_link_put(link, from ? ray_mailbox_addr(from) : 0, to, mail->buf.base, len);
+  ray_mail_free(mail);
+  return 0;
+}
+
+/* The local address of `remote` on the other side, 0 if it can't have one.
+   Proxies are looked up by a walk, a link talks to few peers. */
+ray_addr_t ray_link_proxy(ray_link_t* self, ray_addr_t remote) {
+  ray_proxy_t* proxy = self->proxies;
+  while (proxy && proxy->remote != remote) proxy = proxy->next;
+  if (!proxy) {
+    ray_handle_t* handle = ray_handle_new(self->handle->queue, UV_FILE);
+    if (!handle) return 0;
+    proxy = (ray_proxy_t*)calloc(1, sizeof(ray_proxy_t));
+    if (!proxy) {
+      ray_handle_free(handle);
+      return 0;
+    }
+    proxy->handle = handle;
+    proxy->link   = self;
+    proxy->remote = remote;
+    proxy->next   = self->proxies;
+    self->proxies = proxy;
+    handle->proxy = proxy;
+  }
+  return ray_mailbox_addr(proxy->handle);
+}
+
+uv_buf_t ray_link_alloc_cb(uv_handle_t* handle, size_t size) {
+  ray_link_t* self = container_of(handle, ray_handle_t, u)->link;
+  ray_buf_need(&self->rbuf, RAY_BUF_SIZE * 16);
+  size_t used = ray_buf_get_offset(&self->rbuf);
+  return uv_buf_init((char*)self->rbuf.head, (unsigned int)(self->rbuf.size - used));
+}
+
+/* -1 if the frame isn't complete yet, -2 if it is bad */
+static ssize_t ray_link_frame(const uint8_t* p, size_t avail, uint32_t* len) {
+  size_t   n = 0;
+  uint32_t v = 0;
+  int      sh = 0;
+  for (;;) {
+    if (n == avail) return -1;
+    if (sh > 28) return -2;
+    v |= (uint32_t)(p[n] & 0x7f) << sh;
+    sh += 7;
+    if (p[n++] < 0x80) break;
+  }
+  if (v > RAY_MAIL_MAX) return -2;
+  if (avail - n < 16 + (size_t)v) return -1;
+  *len = v;
+  return (ssize_t)n;
+}
+
+void ray_link_read_cb(uv_stream_t* stream, ssize_t nread, uv_buf_t buf) {
+  ray_handle_t* handle = container_of(stream, ray_handle_t, u);
+  ray_link_t*   self   = handle->link;
+  if (nread == 0) return;
+  if (nread < 0) {
+    ray_evt_t evt = ray_evt_init(handle, RAY_ERROR, (int)nread, NULL);
+    uv_read_stop(stream);
+    ray_queue_post(handle->queue, &evt);
+    return;
+  }
+  self->rbuf.head += nread;
+
+  uint8_t* p     = self->rbuf.base;
+  size_t   avail = ray_buf_get_offset(&self->rbuf);
+  for (;;) {
+    uint32_t len;
+    ssize_t  n = ray_link_frame(p, avail, &len);
+    if (n == -1) break;
+    if (n == -2) {
+      ray_evt_t evt = ray_evt_init(handle, RAY_ERROR, UV__EINVAL, NULL);
+      uv_read_stop(stream);
+      ray_queue_post(handle->queue, &evt);
+      return;
+    }
+    ray_mail_t* mail = ray_mail_new(len);
+    if (!mail || !mail->buf.base) {
+      ray_evt_t evt = ray_evt_init(handle, RAY_ERROR, UV__ENOMEM, NULL);
+      if (mail) ray_mail_free(mail);
+      uv_read_stop(stream);
+      ray_queue_post(handle->queue, &evt);
+      return;
+    }
+    ray_buf_t hdr;
+    hdr.head = hdr.base = p + n;
+    hdr.size = 16;
+    ray_addr_t to   = ray_buf_get_uint64(&hdr);
+    ray_addr_t from = ray_buf_get_uint64(&hdr);
+    if (!(to >> 32)) to |= (ray_addr_t)handle->queue->qid << 32;
+    memcpy(mail->buf.base, p + n + 16, len);
+    mail->len  = len;
+    mail->from = from ? ray_link_proxy(self, from) : 0;
+    ray_mail_route(to, mail);
+
+    p     += n + 16 + len;
+    avail -= n + 16 + len;
+  }
+  memmove(self->rbuf.base, p, avail);
+  self->rbuf.head = self->rbuf.base + avail;
+}
+
+/* Starts exchanging messages over `fd`, one end of a pipe or socketpair.
+   Messages arrive from proxies of their senders, errors and EOF as
+   RAY_ERROR on the link. */
+ray_handle_t* ray_link_new(ray_queue_t* queue, ray_file_t fd) {
+  ray_link_t* link = (ray_link_t*)calloc(1, sizeof(ray_link_t));
+  if (!link) return NULL;
+  ray_handle_t* self = ray_handle_new(queue, UV_NAMED_PIPE);
+  if (!self) {
+    free(link);
+    return NULL;
+  }
+  link->handle = self;
+  self->link   = link;
+  if (uv_pipe_init(queue->loop, &self->u.pipe, 0)) {
+    ray_handle_free(self);
+    return NULL;
+  }
+  if (uv_pipe_open(&self->u.pipe, fd)
+  || uv_read_start(&self->u.stream, ray_link_alloc_cb, ray_link_read_cb)) {
+    uv_close(&self->u.handle, ray_free_cb);
+    return NULL;
+  }
+  return self;
+}
+
+void ray_link_free(ray_link_t* self) {
+  while (self->proxies) {
+    ray_proxy_t* proxy = self->proxies;
+    self->proxies = proxy->next;
+    proxy->handle->proxy = NULL;
+    ray_handle_free(proxy->handle);
+    free(proxy);
+  }
+  free(self->rbuf.base);
+  free(self->obuf.base);
+  free(self->wbuf.base);
+  free(self);
+}
+
+/* ========================================================================== */
+/* idle                                                                       */
+/* ========================================================================== */
+void ray_idle_cb(uv_idle_t* idle, int status) {
+  ray_handle_t* self = container_of(idle, ray_handle_t, u);
+  ray_evt_t evt = ray_evt_init(self, RAY_IDLE, status, NULL);
+  ray_queue_post(self->queue, &evt);
+}
+
+ray_handle_t* ray_idle_new(ray_queue_t* queue) {
+  ray_handle_t* self = ray_handle_new(queue, UV_IDLE);
+  if (!self) return NULL;
+  uv_idle_init(self->queue->loop, &self->u.idle);
+  return self;
+}
+int ray_idle_start(ray_handle_t* self) {
+  return uv_idle_start(&self->u.idle, ray_idle_cb);
+}
+int ray_idle_stop(ray_handle_t* self) {
+  return uv_idle_stop(&self->u.idle);
+}
+
+/* ========================================================================== */
 /* file system                                                                */
 /* ========================================================================== */
 void ray_stat_init(ray_stat_t* self, uv_stat_t* s) {
@@ -328,8 +2264,45 @@ void ray_stat_init(ray_stat_t* self, uv_stat_t* s) {
   }
 }
 
+/* for stat buffers filled outside of libuv, i.e. on worker threads */
+void ray_stat_init_sys(ray_stat_t* self, struct stat* s) {
+  self->dev = s->st_dev;
+  self->ino = s->st_ino;
+  self->mode = s->st_mode;
+  self->nlink = s->st_nlink;
+  self->uid = s->st_uid;
+  self->gid = s->st_gid;
+  self->rdev = s->st_rdev;
+  self->size = s->st_size;
+#if defined(__APPLE__)
+  self->atim.tv_sec = s->st_atimespec.tv_sec;
+  self->atim.tv_nsec = s->st_atimespec.tv_nsec;
+  self->mtim.tv_sec = s->st_mtimespec.tv_sec;
+  self->mtim.tv_nsec = s->st_mtimespec.tv_nsec;
+  self->ctim.tv_sec = s->st_ctimespec.tv_sec;
+  self->ctim.tv_nsec = s->st_ctimespec.tv_nsec;
+#elif defined(_WIN32)
+  self->atim.tv_sec = s->st_atime;
+  self->atim.tv_nsec = 0;
+  self->mtim.tv_sec = s->st_mtime;
+  self->mtim.tv_nsec = 0;
+  self->ctim.tv_sec = s->st_ctime;
+  self->ctim.tv_nsec = 0;
+#else
+  self->atim.tv_sec = s->st_atim.tv_sec;
+  self->atim.tv_nsec = s->st_atim.tv_nsec;
+  self->mtim.tv_sec = s->st_mtim.tv_sec;
+  self->mtim.tv_nsec = s->st_mtim.tv_nsec;
+  self->ctim.tv_sec = s->st_ctim.tv_sec;
+  self->ctim.tv_nsec = s->st_ctim.tv_nsec;
+#endif
+}
+
 void ray_fs_cb(uv_fs_t* req) {
+  ray_queue_t* queue = (ray_queue_t*)req->loop->data;
+  ray_msg_t* msg = container_of(req, ray_msg_t, u);
   ray_evt_t evt;
+  RAY_TRACE_ADD(queue, RAY_TRACE_FS_COMPLETE, 0, msg->type, (int32_t)msg->tseq);
   if (req->result < 0) {
     evt = ray_evt_init(NULL, RAY_ERROR, req->result, NULL);
   }
@@ -419,20 +2392,25 @@ void ray_fs_cb(uv_fs_t* req) {
       case UV_FS_READLINK:
         type = RAY_FS_READLINK;
         info = strlen(req->ptr);
-        data = strdup(req->ptr);
+        data = ray_mem_strdup(queue, RAY_MEM_STRING, req->ptr);
         break;
       case UV_FS_READDIR: {
+        /* the names are packed after the entries, one block to free */
         int i;
         ray_dir_t* dirs;
+        char*  ptr = (char*)req->ptr;
+        size_t size = 0;
         type = RAY_FS_READDIR;
         info = req->result;
-        data = calloc(info, sizeof(ray_dir_t));
+        for (i = 0; i < info; i++) size += strlen(ptr + size) + 1;
+        data = ray_mem_alloc(queue, RAY_MEM_FS, info * sizeof(ray_dir_t) + size);
+        if (!data) break;
         dirs = (ray_dir_t*)data;
-        char* ptr = (char*)req->ptr;
+        memcpy(dirs + info, ptr, size);
+        ptr = (char*)(dirs + info);
         for (i = 0; i < info; i++) {
-          char*  name = strdup(ptr);
           size_t nlen = strlen(ptr);
-          dirs[i].name = name;
+          dirs[i].name = ptr;
           dirs[i].nlen = nlen;
           ptr += nlen + 1;
         }
@@ -440,20 +2418,20 @@ void ray_fs_cb(uv_fs_t* req) {
       }
       case UV_FS_STAT: {
         type = RAY_FS_STAT;
-        data = malloc(sizeof(ray_stat_t));
-        ray_stat_init((ray_stat_t*)data, (uv_stat_t*)req->ptr);
+        data = ray_mem_alloc(queue, RAY_MEM_FS, sizeof(ray_stat_t));
+        if (data) ray_stat_init((ray_stat_t*)data, (uv_stat_t*)req->ptr);
         break;
       }
       case UV_FS_LSTAT: {
         type = RAY_FS_LSTAT;
-        data = malloc(sizeof(ray_stat_t));
-        ray_stat_init((ray_stat_t*)data, (uv_stat_t*)req->ptr);
+        data = ray_mem_alloc(queue, RAY_MEM_FS, sizeof(ray_stat_t));
+        if (data) ray_stat_init((ray_stat_t*)data, (uv_stat_t*)req->ptr);
         break;
       }
       case UV_FS_FSTAT: {
-        type = RAY_FS_READDIR;
-        data = malloc(sizeof(ray_stat_t));
-        ray_stat_init((ray_stat_t*)data, (uv_stat_t*)req->ptr);
+        type = RAY_FS_FSTAT;
+        data = ray_mem_alloc(queue, RAY_MEM_FS, sizeof(ray_stat_t));
+        if (data) ray_stat_init((ray_stat_t*)data, (uv_stat_t*)req->ptr);
         break;
       }
 
@@ -462,13 +2440,20 @@ void ray_fs_cb(uv_fs_t* req) {
         abort();
       }
     }
-    evt = ray_evt_init(NULL, type, info, data);
+    if (!data && (type == RAY_FS_READLINK || type == RAY_FS_READDIR ||
+                  type == RAY_FS_STAT || type == RAY_FS_LSTAT ||
+                  type == RAY_FS_FSTAT)) {
+      evt = ray_evt_init(NULL, RAY_ERROR, UV__ENOMEM, NULL);
+    }
+    else {
+      evt = ray_evt_init(NULL, type, info, data);
+    }
   }
 
   uv_fs_req_cleanup(req);
-  ray_msg_done(container_of(req, ray_msg_t, u));
+  ray_msg_done(msg);
 
-  ray_queue_post((ray_queue_t*)req->loop->data, &evt);
+  ray_queue_post(queue, &evt);
 }
 
 int ray_str_flags(const char* str) {
@@ -493,108 +2478,1602 @@ int ray_str_flags(const char* str) {
   assert(0 && "Unknown file open flag");
 }
 
-int ray_fs_open(ray_queue_t* queue, const char *path, const char* how, int mode) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
-  int flags = ray_str_flags(how);
-  return uv_fs_open(queue->loop, req, path, flags, mode, ray_fs_cb);
+/* ========================================================================== */
+/* io_uring file system engine                                                */
+/* ========================================================================== */
+#ifdef RAY_USE_URING
+typedef struct ray_uring_op_s {
+  int          type;
+  uint32_t     tseq;  /* trace sequence number */
+  char*        path;
+  void*        buf;
+  struct statx stx;
+} ray_uring_op_t;
+
+int ray_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+int ray_uring_probe(int fd) {
+  static const int need[] = {
+    IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ, IORING_OP_WRITE,
+    IORING_OP_STATX, IORING_OP_FSYNC
+  };
+  size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, size);
+  int i, ok = 1;
+
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+    free(probe);
+    return 0;
+  }
+  for (i = 0; i < (int)(sizeof(need) / sizeof(need[0])); i++) {
+    if (need[i] > probe->last_op
+    || !(probe->ops[need[i]].flags & IO_URING_OP_SUPPORTED)) ok = 0;
+  }
+  free(probe);
+  return ok;
 }
 
-int ray_fs_read(ray_queue_t* queue, ray_file_t fh, char* buf, size_t len, int64_t ofs) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
-  return uv_fs_read(queue->loop, req, fh, buf, len, ofs, ray_fs_cb); 
-}
+void ray_stat_init_statx(ray_stat_t* self, struct statx* s) {
+  self->dev = ((uint64_t)s->stx_dev_major << 32) | s->stx_dev_minor;
+  self->ino = s->stx_ino;
+  self->mode = s->stx_mode;
+  self->nlink = s->stx_nlink;
+  self->uid = s->stx_uid;
+  self->gid = s->stx_gid;
+  self->rdev = ((uint64_t)s->stx_rdev_major << 32) | s->stx_rdev_minor;
+  self->size = s->stx_size;
 
-int ray_fs_unlink(ray_queue_t* queue, const char* path) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
-  return uv_fs_unlink(queue->loop, req, path, ray_fs_cb);
-}
+  self->atim.tv_sec = s->stx_atime.tv_sec;
+  self->atim.tv_nsec = s->stx_atime.tv_nsec;
 
-int ray_fs_write(ray_queue_t* queue, ray_file_t file, void* buf, size_t len, int64_t ofs) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
-  return uv_fs_write(queue->loop, req, file, buf, len, ofs, ray_fs_cb);
-}
+  self->mtim.tv_sec = s->stx_mtime.tv_sec;
+  self->mtim.tv_nsec = s->stx_mtime.tv_nsec;
 
-int ray_fs_mkdir(ray_queue_t* queue, const char* path, int mode) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
-  return uv_fs_mkdir(queue->loop, req, path, mode, ray_fs_cb);
+  self->ctim.tv_sec = s->stx_ctime.tv_sec;
+  self->ctim.tv_nsec = s->stx_ctime.tv_nsec;
 }
 
-int ray_fs_rmdir(ray_queue_t* queue, const char* path) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
-  return uv_fs_rmdir(queue->loop, req, path, ray_fs_cb);
+ray_uring_op_t* ray_uring_op_new(int type, const char* path) {
+  ray_uring_op_t* op = (ray_uring_op_t*)malloc(sizeof(ray_uring_op_t));
+  op->type = type;
+  op->path = path ? strdup(path) : NULL;
+  op->buf  = NULL;
+  return op;
 }
-
-int ray_fs_readdir(ray_queue_t* queue, const char* path) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
-  return uv_fs_readdir(queue->loop, req, path, 0, ray_fs_cb);
+void ray_uring_op_free(ray_uring_op_t* op) {
+  if (op->path) free(op->path);
+  free(op);
 }
 
-int ray_fs_stat(ray_queue_t* queue, const char* path) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
-  return uv_fs_stat(queue->loop, req, path, ray_fs_cb);
-}
+void ray_uring_reap(ray_uring_t* self) {
+  unsigned head = *self->cq_head;
+  unsigned tail = __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE);
 
-int ray_fs_rename(ray_queue_t* queue, const char* old_path, const char* new_path) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
-  return uv_fs_rename(queue->loop, req, old_path, new_path, ray_fs_cb);
-}
+  while (head != tail) {
+    struct io_uring_cqe* cqe = &self->cqes[head & self->cq_mask];
+    ray_uring_op_t* op = (ray_uring_op_t*)(uintptr_t)cqe->user_data;
+    int res = cqe->res;
+    ray_evt_t evt;
+    head++;
+    RAY_TRACE_ADD(self->queue, RAY_TRACE_FS_COMPLETE, 0, op->type,
+                  (int32_t)op->tseq);
 
-int ray_fs_sendfile(ray_queue_t* queue, ray_file_t ofh, ray_file_t ifh, int64_t ofs, size_t len) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
-  return uv_fs_sendfile(queue->loop, req, ofh, ifh, ofs, len, ray_fs_cb);
-}
+    if (res < 0) {
+      evt = ray_evt_init(NULL, RAY_ERROR, res, NULL);
+    }
+    else if (op->type == RAY_FS_STAT) {
+      ray_stat_t* stat = (ray_stat_t*)ray_mem_alloc(self->queue, RAY_MEM_FS, sizeof(ray_stat_t));
+      if (stat) {
+        ray_stat_init_statx(stat, &op->stx);
+        evt = ray_evt_init(NULL, RAY_FS_STAT, 0, stat);
+      }
+      else {
+        evt = ray_evt_init(NULL, RAY_ERROR, UV__ENOMEM, NULL);
+      }
+    }
+    else {
+      evt = ray_evt_init(NULL, op->type, res, op->type == RAY_FS_READ ? op->buf : NULL);
+    }
 
-int ray_fs_chmod(ray_queue_t* queue, const char* path, int mode) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
-  return uv_fs_chmod(queue->loop, req, path, mode, ray_fs_cb);
+    ray_uring_op_free(op);
+
+    self->ninflight--;
+    ray_queue_post(self->queue, &evt);
+  }
+  __atomic_store_n(self->cq_head, head, __ATOMIC_RELEASE);
+
+  if (self->ninflight == 0) uv_unref((uv_handle_t*)&self->poll);
 }
 
-int ray_fs_fchmod(ray_queue_t* queue, ray_file_t file, int mode) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
-  return uv_fs_fchmod(queue->loop, req, file, mode, ray_fs_cb);
+int ray_uring_flush(ray_uring_t* self) {
+  while (self->nqueued) {
+    int rc = ray_uring_enter(self->fd, self->nqueued, 0, 0);
+    if (rc < 0) {
+      if (errno == EINTR) continue;
+      return -errno;
+    }
+    /* nothing consumed, try again on the next loop iteration */
+    if (rc == 0) break;
+    self->nqueued -= rc;
+  }
+  return 0;
 }
 
-int ray_fs_utime(ray_queue_t* queue, const char* path, double atime, double mtime) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
-  return uv_fs_utime(queue->loop, req, path, atime, mtime, ray_fs_cb);
+/* everything prepared during one loop iteration goes in with one syscall */
+void ray_uring_prepare_cb(uv_prepare_t* handle, int status) {
+  ray_uring_t* self = container_of(handle, ray_uring_t, prepare);
+  ray_uring_flush(self);
+}
+void ray_uring_poll_cb(uv_poll_t* handle, int status, int events) {
+  ray_uring_t* self = container_of(handle, ray_uring_t, poll);
+  ray_uring_reap(self);
+}
+
+/* returns NULL when the rings are saturated, the caller then falls back to
+   the threadpool rather than risking completion queue overflow */
+struct io_uring_sqe* ray_uring_sqe(ray_uring_t* self, ray_uring_op_t* op) {
+  unsigned tail = *self->sq_tail;
+  unsigned head = __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE);
+
+  if (self->ninflight >= self->cq_entries) return NULL;
+  if (tail - head >= self->sq_entries) {
+    if (ray_uring_flush(self)) return NULL;
+    head = __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= self->sq_entries) return NULL;
+  }
+
+  unsigned idx = tail & self->sq_mask;
+  struct io_uring_sqe* sqe = &self->sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->user_data = (uint64_t)(uintptr_t)op;
+  op->tseq = ray_trace_op(self->queue);
+  RAY_TRACE_ADD(self->queue, RAY_TRACE_FS_SUBMIT, 0, op->type, (int32_t)op->tseq);
+
+  self->sq_array[idx] = idx;
+  __atomic_store_n(self->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  self->nqueued++;
+  if (self->ninflight++ == 0) uv_ref((uv_handle_t*)&self->poll);
+  return sqe;
+}
+
+/* each submit function returns 1 when the ring is full and the operation
+   should go to the threadpool instead */
+int ray_uring_open(ray_uring_t* self, const char* path, int flags, int mode) {
+  ray_uring_op_t* op = ray_uring_op_new(RAY_FS_OPEN, path);
+  struct io_uring_sqe* sqe = ray_uring_sqe(self, op);
+  if (!sqe) {
+    ray_uring_op_free(op);
+    return 1;
+  }
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t)(uintptr_t)op->path;
+  sqe->len = mode;
+  sqe->open_flags = flags;
+  return 0;
+}
+
+int ray_uring_close(ray_uring_t* self, ray_file_t file) {
+  ray_uring_op_t* op = ray_uring_op_new(RAY_FS_CLOSE, NULL);
+  struct io_uring_sqe* sqe = ray_uring_sqe(self, op);
+  if (!sqe) {
+    ray_uring_op_free(op);
+    return 1;
+  }
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = file;
+  return 0;
+}
+
+int ray_uring_rw(ray_uring_t* self, int type, ray_file_t file, void* buf, size_t len, int64_t ofs) {
+  /* kernels without RW_CUR_POS read -1 as an absolute offset */
+  if (ofs < 0 && !(self->features & IORING_FEAT_RW_CUR_POS)) return 1;
+  ray_uring_op_t* op = ray_uring_op_new(type, NULL);
+  struct io_uring_sqe* sqe = ray_uring_sqe(self, op);
+  if (!sqe) {
+    ray_uring_op_free(op);
+    return 1;
+  }
+  op->buf = buf;
+  sqe->opcode = type == RAY_FS_READ ? IORING_OP_READ : IORING_OP_WRITE;
+  sqe->fd = file;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = (unsigned)len;
+  /* -1 means the current file position, as with the threadpool */
+  sqe->off = (uint64_t)ofs;
+  return 0;
+}
+
+int ray_uring_stat(ray_uring_t* self, const char* path) {
+  ray_uring_op_t* op = ray_uring_op_new(RAY_FS_STAT, path);
+  struct io_uring_sqe* sqe = ray_uring_sqe(self, op);
+  if (!sqe) {
+    ray_uring_op_free(op);
+    return 1;
+  }
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t)(uintptr_t)op->path;
+  sqe->len = STATX_BASIC_STATS;
+  sqe->off = (uint64_t)(uintptr_t)&op->stx;
+  return 0;
+}
+
+int ray_uring_fsync(ray_uring_t* self, int type, ray_file_t file) {
+  ray_uring_op_t* op = ray_uring_op_new(type, NULL);
+  struct io_uring_sqe* sqe = ray_uring_sqe(self, op);
+  if (!sqe) {
+    ray_uring_op_free(op);
+    return 1;
+  }
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->fd = file;
+  if (type == RAY_FS_FDATASYNC) sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  return 0;
+}
+
+void ray_uring_unmap(ray_uring_t* self) {
+  if (self->sqes) munmap(self->sqes, self->sqes_sz);
+  if (self->cq_ring && self->cq_ring != self->sq_ring) {
+    munmap(self->cq_ring, self->cq_ring_sz);
+  }
+  if (self->sq_ring) munmap(self->sq_ring, self->sq_ring_sz);
+  close(self->fd);
+}
+
+ray_uring_t* ray_uring_new(ray_queue_t* queue, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0) return NULL;
+
+  ray_uring_t* self = (ray_uring_t*)calloc(1, sizeof(ray_uring_t));
+  self->fd       = fd;
+  self->queue    = queue;
+  self->features = p.features;
+
+  if (!ray_uring_probe(fd)) goto fail;
+
+  self->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  self->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (self->cq_ring_sz > self->sq_ring_sz) self->sq_ring_sz = self->cq_ring_sz;
+    self->cq_ring_sz = self->sq_ring_sz;
+  }
+
+  self->sq_ring = mmap(NULL, self->sq_ring_sz, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (self->sq_ring == MAP_FAILED) {
+    self->sq_ring = NULL;
+    goto fail;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    self->cq_ring = self->sq_ring;
+  }
+  else {
+    self->cq_ring = mmap(NULL, self->cq_ring_sz, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (self->cq_ring == MAP_FAILED) {
+      self->cq_ring = NULL;
+      goto fail;
+    }
+  }
+
+  self->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  self->sqes = mmap(NULL, self->sqes_sz, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (self->sqes == MAP_FAILED) {
+    self->sqes = NULL;
+    goto fail;
+  }
+
+  char* sq = (char*)self->sq_ring;
+  self->sq_head    = (unsigned*)(sq + p.sq_off.head);
+  self->sq_tail    = (unsigned*)(sq + p.sq_off.tail);
+  self->sq_array   = (unsigned*)(sq + p.sq_off.array);
+  self->sq_mask    = *(unsigned*)(sq + p.sq_off.ring_mask);
+  self->sq_entries = *(unsigned*)(sq + p.sq_off.ring_entries);
+
+  char* cq = (char*)self->cq_ring;
+  self->cq_head    = (unsigned*)(cq + p.cq_off.head);
+  self->cq_tail    = (unsigned*)(cq + p.cq_off.tail);
+  self->cqes       = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  self->cq_mask    = *(unsigned*)(cq + p.cq_off.ring_mask);
+  self->cq_entries = *(unsigned*)(cq + p.cq_off.ring_entries);
+
+  /* completions wake the loop through the ring descriptor */
+  uv_poll_init(queue->loop, &self->poll, fd);
+  uv_poll_start(&self->poll, UV_READABLE, ray_uring_poll_cb);
+  uv_unref((uv_handle_t*)&self->poll);
+
+  uv_prepare_init(queue->loop, &self->prepare);
+  uv_prepare_start(&self->prepare, ray_uring_prepare_cb);
+  uv_unref((uv_handle_t*)&self->prepare);
+
+  return self;
+
+fail:
+  ray_uring_unmap(self);
+  free(self);
+  return NULL;
+}
+
+void ray_uring_close_cb(uv_handle_t* handle) {
+  ray_uring_t* self = container_of((uv_prepare_t*)handle, ray_uring_t, prepare);
+  ray_uring_unmap(self);
+  free(self);
+}
+/* the queue itself being freed means its loop will not run again, so the
+   watchers are stopped and the rings released right away */
+void ray_uring_free(ray_uring_t* self, int now) {
+  if (now) {
+    uv_poll_stop(&self->poll);
+    uv_prepare_stop(&self->prepare);
+    ray_uring_unmap(self);
+    free(self);
+    return;
+  }
+  uv_close((uv_handle_t*)&self->poll, NULL);
+  uv_close((uv_handle_t*)&self->prepare, ray_uring_close_cb);
+}
+#endif /* RAY_USE_URING */
+
+/* Selects the engine behind ray_fs_open/close/read/write/stat/fsync/fdatasync.
+   Asking for RAY_FS_ENGINE_URING where io_uring is not compiled in or not
+   supported by the kernel returns an error and keeps the threadpool. */
+int ray_queue_set_fs_engine(ray_queue_t* queue, int engine) {
+#ifdef RAY_USE_URING
+  if (engine == RAY_FS_ENGINE_URING) {
+    if (queue->uring) return 0;
+    queue->uring = ray_uring_new(queue, RAY_URING_ENTRIES);
+    return queue->uring ? 0 : UV__ENOSYS;
+  }
+  if (queue->uring) {
+    if (queue->uring->ninflight) return UV__EBUSY;
+    ray_uring_free(queue->uring, 0);
+    queue->uring = NULL;
+  }
+  return 0;
+#else
+  return engine == RAY_FS_ENGINE_URING ? UV__ENOSYS : 0;
+#endif
+}
+int ray_queue_get_fs_engine(ray_queue_t* queue) {
+  return queue->uring ? RAY_FS_ENGINE_URING : RAY_FS_ENGINE_THREADPOOL;
+}
+
+/* a request from the message ring, recorded as submitted when tracing */
+uv_fs_t* ray_fs_req(ray_queue_t* queue, int type) {
+  ray_msg_t* msg = ray_msg_next(queue);
+  msg->type = type;
+  msg->tseq = ray_trace_op(queue);
+  RAY_TRACE_ADD(queue, RAY_TRACE_FS_SUBMIT, 0, type, (int32_t)msg->tseq);
+  return &msg->u.fs;
+}
+
+int ray_fs_open(ray_queue_t* queue, const char *path, const char* how, int mode) {
+  int flags = ray_str_flags(how);
+#ifdef RAY_USE_URING
+  if (queue->uring && !ray_uring_open(queue->uring, path, flags, mode)) return 0;
+#endif
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_OPEN);
+  return uv_fs_open(queue->loop, req, path, flags, mode, ray_fs_cb);
+}
+
+int ray_fs_close(ray_queue_t* queue, ray_file_t file) {
+#ifdef RAY_USE_URING
+  if (queue->uring && !ray_uring_close(queue->uring, file)) return 0;
+#endif
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_CLOSE);
+  return uv_fs_close(queue->loop, req, file, ray_fs_cb);
+}
+
+int ray_fs_read(ray_queue_t* queue, ray_file_t fh, char* buf, size_t len, int64_t ofs) {
+#ifdef RAY_USE_URING
+  if (queue->uring && !ray_uring_rw(queue->uring, RAY_FS_READ, fh, buf, len, ofs)) return 0;
+#endif
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_READ);
+  req->data = buf;
+  return uv_fs_read(queue->loop, req, fh, buf, len, ofs, ray_fs_cb); 
+}
+
+int ray_fs_unlink(ray_queue_t* queue, const char* path) {
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_UNLINK);
+  return uv_fs_unlink(queue->loop, req, path, ray_fs_cb);
+}
+
+int ray_fs_write(ray_queue_t* queue, ray_file_t file, void* buf, size_t len, int64_t ofs) {
+#ifdef RAY_USE_URING
+  if (queue->uring && !ray_uring_rw(queue->uring, RAY_FS_WRITE, file, buf, len, ofs)) return 0;
+#endif
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_WRITE);
+  return uv_fs_write(queue->loop, req, file, buf, len, ofs, ray_fs_cb);
+}
+
+int ray_fs_mkdir(ray_queue_t* queue, const char* path, int mode) {
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_MKDIR);
+  return uv_fs_mkdir(queue->loop, req, path, mode, ray_fs_cb);
+}
+
+int ray_fs_rmdir(ray_queue_t* queue, const char* path) {
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_RMDIR);
+  return uv_fs_rmdir(queue->loop, req, path, ray_fs_cb);
+}
+
+int ray_fs_readdir(ray_queue_t* queue, const char* path) {
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_READDIR);
+  return uv_fs_readdir(queue->loop, req, path, 0, ray_fs_cb);
+}
+
+int ray_fs_stat(ray_queue_t* queue, const char* path) {
+#ifdef RAY_USE_URING
+  if (queue->uring && !ray_uring_stat(queue->uring, path)) return 0;
+#endif
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_STAT);
+  return uv_fs_stat(queue->loop, req, path, ray_fs_cb);
+}
+
+int ray_fs_fstat(ray_queue_t* queue, ray_file_t file) {
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_FSTAT);
+  return uv_fs_fstat(queue->loop, req, file, ray_fs_cb);
+}
+
+int ray_fs_fsync(ray_queue_t* queue, ray_file_t file) {
+#ifdef RAY_USE_URING
+  if (queue->uring && !ray_uring_fsync(queue->uring, RAY_FS_FSYNC, file)) return 0;
+#endif
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_FSYNC);
+  return uv_fs_fsync(queue->loop, req, file, ray_fs_cb);
+}
+
+int ray_fs_fdatasync(ray_queue_t* queue, ray_file_t file) {
+#ifdef RAY_USE_URING
+  if (queue->uring && !ray_uring_fsync(queue->uring, RAY_FS_FDATASYNC, file)) return 0;
+#endif
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_FDATASYNC);
+  return uv_fs_fdatasync(queue->loop, req, file, ray_fs_cb);
+}
+
+int ray_fs_rename(ray_queue_t* queue, const char* old_path, const char* new_path) {
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_RENAME);
+  return uv_fs_rename(queue->loop, req, old_path, new_path, ray_fs_cb);
+}
+
+int ray_fs_sendfile(ray_queue_t* queue, ray_file_t ofh, ray_file_t ifh, int64_t ofs, size_t len) {
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_SENDFILE);
+  return uv_fs_sendfile(queue->loop, req, ofh, ifh, ofs, len, ray_fs_cb);
+}
+
+int ray_fs_chmod(ray_queue_t* queue, const char* path, int mode) {
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_CHMOD);
+  return uv_fs_chmod(queue->loop, req, path, mode, ray_fs_cb);
+}
+
+int ray_fs_fchmod(ray_queue_t* queue, ray_file_t file, int mode) {
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_FCHMOD);
+  return uv_fs_fchmod(queue->loop, req, file, mode, ray_fs_cb);
+}
+
+int ray_fs_utime(ray_queue_t* queue, const char* path, double atime, double mtime) {
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_UTIME);
+  return uv_fs_utime(queue->loop, req, path, atime, mtime, ray_fs_cb);
 }
 
 int ray_fs_futime(ray_queue_t* queue, ray_file_t file, double atime, double mtime) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_FUTIME);
   return uv_fs_futime(queue->loop, req, file, atime, mtime, ray_fs_cb);
 }
 
 int ray_fs_lstat(ray_queue_t* queue, const char* path) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_LSTAT);
   return uv_fs_lstat(queue->loop, req, path, ray_fs_cb);
 }
 
 int ray_fs_link(ray_queue_t* queue, const char* path, const char* new_path) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_LINK);
   return uv_fs_link(queue->loop, req, path, new_path, ray_fs_cb);
 }
 
 int ray_fs_symlink(ray_queue_t* queue, const char* p1, const char* p2, const char* f) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_SYMLINK);
   int flags = ray_str_flags(f);
   return uv_fs_symlink(queue->loop, req, p1, p2, flags, ray_fs_cb);
 }
 
 int ray_fs_readlink(ray_queue_t* queue, const char* path) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_READLINK);
   return uv_fs_readlink(queue->loop, req, path, ray_fs_cb);
 }
 
 int ray_fs_chown(ray_queue_t* queue, const char* path, int uid, int gid) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_CHOWN);
   return uv_fs_chown(queue->loop, req, path, uid, gid, ray_fs_cb);
 }
 
 int ray_fs_fchown(ray_queue_t* queue, ray_file_t file, int uid, int gid) {
-  uv_fs_t* req = &(ray_msg_next(queue)->u.fs);
+  uv_fs_t* req = ray_fs_req(queue, RAY_FS_FCHOWN);
   return uv_fs_fchown(queue->loop, req, file, uid, gid, ray_fs_cb);
 }
 
+/* ========================================================================== */
+/* streaming reads                                                            */
+/* ========================================================================== */
+void ray_reader_fill(ray_reader_t* self);
+
+ray_rbuf_t* ray_rbuf_get(ray_reader_t* self) {
+  ray_rbuf_t* buf = self->free;
+  if (buf) {
+    self->free = buf->next;
+    if (buf->size >= self->chunk) return buf;
+    /* left over from before the chunk size grew */
+    ray_mem_free(buf);
+  }
+  buf = (ray_rbuf_t*)ray_mem_alloc(self->handle->queue, RAY_MEM_BUFFER,
+                                   sizeof(ray_rbuf_t) + self->chunk);
+  if (!buf) return NULL;
+  buf->queue = self->handle->queue;
+  buf->id    = self->handle->id;
+  buf->size  = self->chunk;
+  return buf;
+}
+void ray_rbuf_put(ray_reader_t* self, ray_rbuf_t* buf) {
+  if (self->closing) {
+    ray_mem_free(buf);
+    return;
+  }
+  buf->next  = self->free;
+  self->free = buf;
+}
+
+void ray_reader_post(ray_reader_t* self, int type, int info, void* data) {
+  ray_evt_t evt = ray_evt_init(self->handle, type, info, data);
+  ray_queue_post(self->handle->queue, &evt);
+}
+
+/* Grow chunks while the consumer keeps up, i.e. has nothing of ours left
+   when a read lands, and shrink them while it falls behind. */
+void ray_reader_adapt(ray_reader_t* self) {
+  if (self->nheld == 0 && self->chunk < RAY_READER_MAX_CHUNK) {
+    self->chunk *= 2;
+  }
+  else if (self->nheld >= self->depth && self->chunk > RAY_READER_MIN_CHUNK) {
+    self->chunk /= 2;
+  }
+}
+
+/* Delivers finished reads in the order they were issued. Regular files only
+   read short at their end, so a short read ends the stream and whatever was
+   read ahead past it is dropped. */
+void ray_reader_flush(ray_reader_t* self) {
+  int i;
+  for (i = 0; i < self->depth; i++) {
+    ray_read_op_t* op = &self->ops[i];
+    if (op->state != RAY_READ_DONE || op->seq != self->npost) continue;
+
+    if (self->eof) {
+      ray_rbuf_put(self, op->buf);
+    }
+    else if (op->result < 0) {
+      ray_rbuf_put(self, op->buf);
+      ray_reader_post(self, RAY_FS_ERROR, (int)op->result, NULL);
+      self->eof = 1;
+    }
+    else if (op->result == 0) {
+      ray_rbuf_put(self, op->buf);
+      ray_reader_post(self, RAY_FS_READ, 0, NULL);
+      self->eof = 1;
+    }
+    else {
+      self->nheld++;
+      self->bytes += op->result;
+      ray_reader_post(self, RAY_FS_READ, (int)op->result, op->buf + 1);
+      if ((size_t)op->result < op->len) {
+        ray_reader_post(self, RAY_FS_READ, 0, NULL);
+        self->eof = 1;
+      }
+    }
+    op->buf   = NULL;
+    op->state = RAY_READ_IDLE;
+    self->npost++;
+    i = -1;
+  }
+}
+
+void ray_reader_cb(uv_fs_t* req) {
+  ray_read_op_t* op   = container_of(req, ray_read_op_t, req);
+  ray_reader_t*  self = op->reader;
+
+  if (!self->handle) {
+    RAY_TRACE_ADD(op->buf->queue, RAY_TRACE_FS_COMPLETE, 0, RAY_FS_READ,
+                  (int32_t)op->tseq);
+    uv_fs_req_cleanup(req);
+    ray_mem_free(op->buf);
+    op->buf   = NULL;
+    op->state = RAY_READ_IDLE;
+    if (--self->nbusy == 0) free(self);
+    return;
+  }
+
+  ray_queue_t*   queue = self->handle->queue;
+  RAY_TRACE_ADD(queue, RAY_TRACE_FS_COMPLETE, self->handle->id, RAY_FS_READ,
+                (int32_t)op->tseq);
+  op->result = req->result;
+  op->state  = RAY_READ_DONE;
+  uv_fs_req_cleanup(req);
+  self->nbusy--;
+
+  if (self->closing) {
+    ray_rbuf_put(self, op->buf);
+    op->buf   = NULL;
+    op->state = RAY_READ_IDLE;
+    if (self->nbusy == 0) ray_reader_post(self, RAY_CLOSE, 0, NULL);
+    return;
+  }
+  if ((size_t)op->result == op->len) ray_reader_adapt(self);
+  ray_reader_flush(self);
+  ray_reader_fill(self);
+}
+
+/* keeps up to `depth` reads in flight, one more buffer may be held by the
+   consumer before reading ahead backs off */
+void ray_reader_fill(ray_reader_t* self) {
+  ray_queue_t* queue = self->handle->queue;
+  int i;
+  while (!self->paused && !self->eof && !self->closing) {
+    ray_read_op_t* op = NULL;
+    int used = 0;
+    for (i = 0; i < self->depth; i++) {
+      if (self->ops[i].state != RAY_READ_IDLE) used++;
+      else if (!op) op = &self->ops[i];
+    }
+    if (!op || used + self->nheld > self->depth) return;
+
+    ray_rbuf_t* buf = ray_rbuf_get(self);
+    if (!buf) {
+      ray_reader_post(self, RAY_FS_ERROR, UV__ENOMEM, NULL);
+      self->eof = 1;
+      return;
+    }
+    op->buf = buf;
+    op->len = self->chunk;
+    op->seq = self->nsubmit;
+    int rc = uv_fs_read(queue->loop, &op->req, self->file, buf + 1, op->len,
+                        self->ofs, ray_reader_cb);
+    if (rc) {
+      ray_rbuf_put(self, buf);
+      op->buf = NULL;
+      ray_reader_post(self, RAY_FS_ERROR, rc, NULL);
+      self->eof = 1;
+      return;
+    }
+    op->tseq = ray_trace_op(queue);
+    RAY_TRACE_ADD(queue, RAY_TRACE_FS_SUBMIT, self->handle->id, RAY_FS_READ,
+                  (int32_t)op->tseq);
+    op->state = RAY_READ_BUSY;
+    self->nsubmit++;
+    self->nbusy++;
+    self->ofs += op->len;
+  }
+}
+
+/* Streams `file` from `ofs` as RAY_FS_READ events carrying the data, with
+   up to `depth` (1 or 2, 0 for the default) reads kept ahead of the
+   consumer. The end of the file is a RAY_FS_READ with info 0, a failed read
+   a RAY_FS_ERROR, and either ends the stream. The file stays the caller's. */
+ray_handle_t* ray_reader_new(ray_queue_t* queue, ray_file_t file, int64_t ofs, int depth) {
+  ray_reader_t* reader = (ray_reader_t*)calloc(1, sizeof(ray_reader_t));
+  if (!reader) return NULL;
+  ray_handle_t* self = ray_handle_new(queue, UV_FILE);
+  if (!self) {
+    free(reader);
+    return NULL;
+  }
+  int i;
+  if (depth <= 0 || depth > RAY_READER_DEPTH) depth = RAY_READER_DEPTH;
+  reader->handle = self;
+  reader->file   = file;
+  reader->ofs    = ofs;
+  reader->chunk  = RAY_READER_MIN_CHUNK;
+  reader->depth  = depth;
+  for (i = 0; i < RAY_READER_DEPTH; i++) reader->ops[i].reader = reader;
+  self->reader = reader;
+
+  ray_reader_fill(reader);
+  return self;
+}
+
+/* reads in flight still complete and are delivered */
+int ray_reader_pause(ray_handle_t* self) {
+  if (!self->reader) return UV__EINVAL;
+  self->reader->paused = 1;
+  return 0;
+}
+int ray_reader_resume(ray_handle_t* self) {
+  if (!self->reader) return UV__EINVAL;
+  self->reader->paused = 0;
+  ray_reader_fill(self->reader);
+  return 0;
+}
+
+size_t ray_reader_chunk(ray_handle_t* self) {
+  return self->reader ? self->reader->chunk : 0;
+}
+
+/* called with the data of a finished RAY_FS_READ from a reader */
+void ray_reader_release(void* data) {
+  ray_rbuf_t*   buf  = (ray_rbuf_t*)data - 1;
+  ray_handle_t* handle = ray_handle_get(buf->queue, buf->id);
+  if (!handle || !handle->reader) {
+    ray_mem_free(buf);
+    return;
+  }
+  ray_reader_t* self = handle->reader;
+  self->nheld--;
+  ray_rbuf_put(self, buf);
+  ray_reader_fill(self);
+}
+
+/* RAY_CLOSE follows once the reads in flight are back */
+void ray_reader_close(ray_reader_t* self) {
+  if (self->closing) return;
+  self->closing = 1;
+  while (self->free) {
+    ray_rbuf_t* buf = self->free;
+    self->free = buf->next;
+    ray_mem_free(buf);
+  }
+  if (self->nbusy == 0) ray_reader_post(self, RAY_CLOSE, 0, NULL);
+}
+
+/* With reads still in flight the reader outlives its handle, the last
+   callback frees it and the buffers those reads were using. */
+void ray_reader_free(ray_reader_t* self) {
+  int i;
+  for (i = 0; i < self->depth; i++) {
+    ray_read_op_t* op = &self->ops[i];
+    if (op->state == RAY_READ_BUSY) continue;
+    ray_mem_free(op->buf);
+    op->buf = NULL;
+  }
+  while (self->free) {
+    ray_rbuf_t* buf = self->free;
+    self->free = buf->next;
+    ray_mem_free(buf);
+  }
+  if (self->nbusy) {
+    self->handle  = NULL;
+    self->closing = 1;
+    return;
+  }
+  free(self);
+}
+
+/* ========================================================================== */
+/* append log                                                                 */
+/* ========================================================================== */
+void ray_log_start(ray_log_t* self);
+
+void ray_log_post(ray_log_t* self, int type, int info) {
+  ray_evt_t evt = ray_evt_init(self->handle, type, info, NULL);
+  ray_queue_post(self->handle->queue, &evt);
+}
+
+void ray_log_release(ray_log_t* self) {
+  ray_mem_free(self->buf);
+  ray_mem_free(self->wbuf);
+  free(self);
+}
+
+void ray_log_timer_close_cb(uv_handle_t* handle) {
+  ray_log_t* self = container_of(handle, ray_log_t, timer);
+  self->closed = 1;
+  if (self->handle) ray_log_post(self, RAY_CLOSE, 0);
+  else if (!self->flushing) ray_log_release(self);
+}
+
+void ray_log_timer_cb(uv_timer_t* timer, int status) {
+  ray_log_t* self = container_of(timer, ray_log_t, timer);
+  self->armed = 0;
+  if (!self->flushing && self->len) ray_log_start(self);
+}
+
+/* on the threadpool, one write and one sync for the whole group */
+void ray_log_work_cb(uv_work_t* req) {
+  ray_log_t* self = container_of(req, ray_log_t, work);
+  size_t  done = 0;
+  int64_t ofs  = self->ofs;
+  self->werr = 0;
+  while (done < self->wlen) {
+    ssize_t n = pwrite(self->file, self->wbuf + done, self->wlen - done, ofs + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      self->werr = -errno;
+      return;
+    }
+    done += n;
+  }
+#if defined(__APPLE__)
+  if (fsync(self->file)) self->werr = -errno;
+#else
+  if (fdatasync(self->file)) self->werr = -errno;
+#endif
+}
+
+void ray_log_after_cb(uv_work_t* req, int status) {
+  ray_log_t* self = container_of(req, ray_log_t, work);
+  self->flushing = 0;
+  if (!self->handle) {
+    /* freed while this flush ran */
+    if (self->closed) ray_log_release(self);
+    else if (!uv_is_closing((uv_handle_t*)&self->timer)) {
+      uv_close((uv_handle_t*)&self->timer, ray_log_timer_close_cb);
+    }
+    return;
+  }
+  self->err = status ? status : self->werr;
+
+  if (self->err) {
+    /* nothing after the last durable record can be trusted to be there */
+    ray_log_post(self, RAY_FS_ERROR, self->err);
+    self->len = 0;
+  }
+  else {
+    self->ofs    += self->wlen;
+    self->durable = self->wseq;
+    self->nsyncs++;
+    ray_log_post(self, RAY_FS_FDATASYNC, 0);
+  }
+  self->wlen = 0;
+
+  /* records that came in meanwhile form the next group right away */
+  if (self->len) ray_log_start(self);
+  if (self->closing && !self->flushing) {
+    uv_close((uv_handle_t*)&self->timer, ray_log_timer_close_cb);
+  }
+}
+
+void ray_log_start(ray_log_t* self) {
+  char*  buf  = self->wbuf;
+  size_t size = self->wsize;
+  if (self->armed) {
+    uv_timer_stop(&self->timer);
+    self->armed = 0;
+  }
+  self->wbuf  = self->buf;
+  self->wsize = self->size;
+  self->wlen  = self->len;
+  self->wseq  = self->seq;
+  self->buf   = buf;
+  self->size  = size;
+  self->len   = 0;
+
+  int rc = uv_queue_work(self->handle->queue->loop, &self->work,
+                         ray_log_work_cb, ray_log_after_cb);
+  if (rc) {
+    self->err = rc;
+    self->wlen = 0;
+    ray_log_post(self, RAY_FS_ERROR, rc);
+    return;
+  }
+  self->flushing = 1;
+}
+
+/* Appends to `file` from `ofs` with group commit. Each RAY_FS_FDATASYNC
+   means more records are durable, ray_log_durable tells up to which
+   sequence number. A failed flush is a RAY_FS_ERROR and fails later
+   appends. The file stays the caller's. */
+ray_handle_t* ray_log_new(ray_queue_t* queue, ray_file_t file, int64_t ofs) {
+  ray_log_t* log = (ray_log_t*)calloc(1, sizeof(ray_log_t));
+  if (!log) return NULL;
+  ray_handle_t* self = ray_handle_new(queue, UV_FILE);
+  if (!self) {
+    free(log);
+    return NULL;
+  }
+  log->handle = self;
+  log->file   = file;
+  log->ofs    = ofs;
+  log->group  = RAY_LOG_GROUP;
+  log->window = RAY_LOG_WINDOW;
+  uv_timer_init(queue->loop, &log->timer);
+  self->log = log;
+  return self;
+}
+
+/* groups are flushed once they reach `group` bytes or `window` ms after
+   their first record, whichever comes first. A `group` of 0 keeps the
+   current size, a `window` of 0 flushes every append right away. */
+int ray_log_config(ray_handle_t* self, size_t group, uint64_t window) {
+  if (!self->log) return UV__EINVAL;
+  if (group) self->log->group = group;
+  self->log->window = window;
+  return 0;
+}
+
+/* stores the record's sequence number in `seq` if given */
+int ray_log_append(ray_handle_t* self, const void* data, size_t len, uint64_t* seq) {
+  ray_log_t* log = self->log;
+  if (!log || log->closing) return UV__EINVAL;
+  if (log->err) return log->err;
+
+  if (log->len + len > log->size) {
+    size_t size = log->size ? log->size : log->group;
+    while (size < log->len + len) size *= 2;
+    char* buf = (char*)ray_mem_realloc(self->queue, RAY_MEM_BUFFER, log->buf, size);
+    if (!buf) return UV__ENOMEM;
+    log->buf  = buf;
+    log->size = size;
+  }
+  memcpy(log->buf + log->len, data, len);
+  log->len += len;
+  log->seq++;
+
+  /* while a flush runs the group just keeps growing */
+  if (!log->flushing) {
+    if (log->len >= log->group || log->window == 0) {
+      ray_log_start(log);
+    }
+    else if (!log->armed) {
+      uv_timer_start(&log->timer, ray_log_timer_cb, log->window, 0);
+      log->armed = 1;
+    }
+  }
+  if (seq) *seq = log->seq;
+  return 0;
+}
+
+/* starts on the buffered records now instead of waiting for the window */
+int ray_log_flush(ray_handle_t* self) {
+  ray_log_t* log = self->log;
+  if (!log) return UV__EINVAL;
+  if (log->err) return log->err;
+  if (!log->flushing && log->len) ray_log_start(log);
+  return 0;
+}
+
+uint64_t ray_log_durable(ray_handle_t* self) {
+  return self->log ? self->log->durable : 0;
+}
+uint64_t ray_log_syncs(ray_handle_t* self) {
+  return self->log ? self->log->nsyncs : 0;
+}
+
+/* buffered records are still flushed, RAY_CLOSE follows the last sync */
+void ray_log_close(ray_log_t* self) {
+  if (self->closing) return;
+  self->closing = 1;
+  if (self->flushing) return;
+  if (self->len && !self->err) {
+    ray_log_start(self);
+    if (self->flushing) return;
+  }
+  uv_close((uv_handle_t*)&self->timer, ray_log_timer_close_cb);
+}
+
+/* the timer has to be closed and a flush in flight has to finish before
+   the memory goes, whichever comes last releases it */
+void ray_log_free(ray_log_t* self) {
+  self->handle  = NULL;
+  self->closing = 1;
+  if (self->closed) {
+    if (!self->flushing) ray_log_release(self);
+    return;
+  }
+  if (self->armed) {
+    uv_timer_stop(&self->timer);
+    self->armed = 0;
+  }
+  if (!self->flushing && !uv_is_closing((uv_handle_t*)&self->timer)) {
+    uv_close((uv_handle_t*)&self->timer, ray_log_timer_close_cb);
+  }
+}
+
+/* ========================================================================== */
+/* open file cache                                                            */
+/* ========================================================================== */
+#define RAY_FCACHE_SIZE     1024
+#define RAY_FCACHE_NEG_TTL  1000
+
+int ray_fs_cache_init(ray_queue_t* queue, size_t max_ents, int64_t neg_ttl) {
+  if (queue->fcache) return UV__EBUSY;
+
+  ray_fcache_t* self = (ray_fcache_t*)calloc(1, sizeof(ray_fcache_t));
+  self->queue    = queue;
+  self->max_ents = max_ents ? max_ents : RAY_FCACHE_SIZE;
+  self->neg_ttl  = neg_ttl >= 0 ? (uint64_t)neg_ttl : 0;
+
+  /* power of two, at least as many buckets as entries */
+  self->nbuckets = 16;
+  while (self->nbuckets < self->max_ents) self->nbuckets *= 2;
+  self->paths = calloc(self->nbuckets, sizeof(ray_fcache_ent_t*));
+  self->fds   = calloc(self->nbuckets, sizeof(ray_fcache_ent_t*));
+
+  queue->fcache = self;
+  return 0;
+}
+
+void ray_fcache_lru_unlink(ray_fcache_t* self, ray_fcache_ent_t* ent) {
+  if (ent->prev) ent->prev->next = ent->next;
+  else self->head = ent->next;
+  if (ent->next) ent->next->prev = ent->prev;
+  else self->tail = ent->prev;
+  ent->prev = ent->next = NULL;
+}
+void ray_fcache_lru_push(ray_fcache_t* self, ray_fcache_ent_t* ent) {
+  ent->prev = NULL;
+  ent->next = self->head;
+  if (self->head) self->head->prev = ent;
+  else self->tail = ent;
+  self->head = ent;
+}
+
+ray_fcache_ent_t* ray_fcache_find(ray_fcache_t* self, const char* path, uint32_t hash) {
+  ray_fcache_ent_t* ent = self->paths[hash & (self->nbuckets - 1)];
+  while (ent) {
+    if (ent->hash == hash && strcmp(ent->path, path) == 0) return ent;
+    ent = ent->hnext;
+  }
+  return NULL;
+}
+
+void ray_fcache_fd_link(ray_fcache_t* self, ray_fcache_ent_t* ent) {
+  ray_fcache_ent_t** slot = &self->fds[(uint32_t)ent->fd & (self->nbuckets - 1)];
+  ent->fnext = *slot;
+  *slot = ent;
+}
+void ray_fcache_fd_unlink(ray_fcache_t* self, ray_fcache_ent_t* ent) {
+  ray_fcache_ent_t** slot = &self->fds[(uint32_t)ent->fd & (self->nbuckets - 1)];
+  while (*slot && *slot != ent) slot = &(*slot)->fnext;
+  if (*slot) *slot = ent->fnext;
+}
+
+void ray_fcache_unwatch(ray_fcache_ent_t* ent) {
+  if (ent->watch) {
+    ent->watch->data = NULL;
+    uv_close(&ent->watch->u.handle, ray_free_cb);
+    ent->watch = NULL;
+  }
+}
+
+void ray_fcache_destroy(ray_fcache_t* self, ray_fcache_ent_t* ent) {
+  ray_fcache_unwatch(ent);
+  if (ent->fd >= 0) {
+    uv_fs_t req;
+    ray_fcache_fd_unlink(self, ent);
+    uv_fs_close(self->queue->loop, &req, ent->fd, NULL);
+    uv_fs_req_cleanup(&req);
+  }
+  free(ent->path);
+  free(ent);
+}
+
+/* drop an entry from lookup, its descriptor lives on while referenced */
+void ray_fcache_retire(ray_fcache_t* self, ray_fcache_ent_t* ent) {
+  ray_fcache_ent_t** slot = &self->paths[ent->hash & (self->nbuckets - 1)];
+  while (*slot && *slot != ent) slot = &(*slot)->hnext;
+  if (*slot) *slot = ent->hnext;
+  ent->hnext = NULL;
+
+  ray_fcache_lru_unlink(self, ent);
+  ray_fcache_unwatch(ent);
+  self->nents--;
+
+  ent->state = RAY_FCACHE_STALE;
+  if (ent->refs == 0) ray_fcache_destroy(self, ent);
+}
+
+void ray_fcache_evict(ray_fcache_t* self) {
+  ray_fcache_ent_t* ent = self->tail;
+  while (ent && self->nents > self->max_ents) {
+    ray_fcache_ent_t* prev = ent->prev;
+    if (ent->state != RAY_FCACHE_PENDING) ray_fcache_retire(self, ent);
+    ent = prev;
+  }
+}
+
+/* a change during the open is noted and dealt with once it completes */
+void ray_fcache_event_cb(uv_fs_event_t* handle, const char* name, int events, int status) {
+  ray_handle_t* watch = container_of(handle, ray_handle_t, u);
+  ray_fcache_ent_t* ent = (ray_fcache_ent_t*)watch->data;
+  if (!ent) return;
+  if (ent->state == RAY_FCACHE_PENDING) ent->changed = 1;
+  else ray_fcache_retire(ent->cache, ent);
+}
+
+void ray_fcache_watch(ray_fcache_ent_t* ent) {
+  ray_handle_t* watch = ray_handle_new(ent->cache->queue, UV_FS_EVENT);
+  uv_loop_t* loop = ent->cache->queue->loop;
+  if (!watch) return;
+  if (uv_fs_event_init(loop, &watch->u.fs_event, ent->path, ray_fcache_event_cb, 0)) {
+    ray_handle_free(watch);
+    return;
+  }
+  uv_unref(&watch->u.handle);
+  watch->data = ent;
+  ent->watch = watch;
+}
+
+void ray_fcache_open_work_cb(uv_work_t* req) {
+  ray_fcache_ent_t* ent = (ray_fcache_ent_t*)req->data;
+  struct stat st;
+  int fd = open(ent->path, O_RDONLY);
+  if (fd < 0) {
+    ent->err = -errno;
+    return;
+  }
+  if (fstat(fd, &st)) {
+    ent->err = -errno;
+    close(fd);
+    return;
+  }
+  ray_stat_init_sys(&ent->stat, &st);
+  ent->fd = fd;
+}
+
+void ray_fcache_open_after_cb(uv_work_t* req, int status) {
+  ray_fcache_ent_t* ent = (ray_fcache_ent_t*)req->data;
+  ray_fcache_t* self = ent->cache;
+  ray_evt_t evt;
+
+  if (!self) {
+    /* the cache went away while the open ran, see ray_fs_cache_free */
+    if (ent->fd >= 0) close(ent->fd);
+    free(ent->path);
+    free(ent);
+    ray_msg_done(container_of(req, ray_msg_t, u));
+    return;
+  }
+  if (status) ent->err = status;
+  if (ent->err) {
+    evt = ray_evt_init(NULL, RAY_ERROR, ent->err,
+                       ray_mem_strdup(self->queue, RAY_MEM_STRING, ent->path));
+    ent->state   = RAY_FCACHE_MISSING;
+    ent->expires = uv_now(self->queue->loop) + self->neg_ttl;
+    /* only a missing file is worth remembering, EMFILE and the like pass */
+    if (self->neg_ttl == 0 || ent->changed ||
+        (ent->err != UV__ENOENT && ent->err != UV__ENOTDIR)) {
+      ray_fcache_retire(self, ent);
+    }
+    else ray_fcache_unwatch(ent);
+  }
+  else {
+    /* the path is only informational, past the hard limit it's left out */
+    evt = ray_evt_init(NULL, RAY_FS_OPEN, ent->fd,
+                       ray_mem_strdup(self->queue, RAY_MEM_STRING, ent->path));
+    ent->state = RAY_FCACHE_READY;
+    ray_fcache_fd_link(self, ent);
+    /* the file changed under the open, the next lookup opens it again */
+    if (ent->changed) ray_fcache_retire(self, ent);
+  }
+
+  ray_msg_done(container_of(req, ray_msg_t, u));
+  ray_queue_post(self->queue, &evt);
+}
+
+/* The watch is armed before the open so that a change in between is seen.
+   On failure the entry is left as it was. */
+int ray_fcache_submit(ray_fcache_t* self, ray_fcache_ent_t* ent) {
+  ray_msg_t* msg = ray_msg_next(self->queue);
+  uv_work_t* req = &msg->u.work;
+  if (!ent->watch) ray_fcache_watch(ent);
+  ent->changed = 0;
+  req->data    = ent;
+  int rc = uv_queue_work(self->queue->loop, req,
+    ray_fcache_open_work_cb, ray_fcache_open_after_cb);
+  if (rc) {
+    ray_fcache_unwatch(ent);
+    ray_msg_done(msg);
+    return rc;
+  }
+  ent->state = RAY_FCACHE_PENDING;
+  ent->err   = 0;
+  return 0;
+}
+
+/* Returns a cached read-only descriptor and fills `stat` without leaving the
+   loop thread. A cached "not found" returns its error. On a miss the open and
+   fstat run as one threadpool job and UV__EAGAIN is returned; RAY_FS_OPEN or
+   RAY_ERROR follows with the path as data, after which the call hits unless
+   the file changed while it was being opened.
+   Descriptors handed out must be given back with ray_fs_cache_close. */
+int ray_fs_cache_open(ray_queue_t* queue, const char* path, ray_stat_t* stat) {
+  if (!queue->fcache) {
+    ray_fs_cache_init(queue, RAY_FCACHE_SIZE, RAY_FCACHE_NEG_TTL);
+  }
+  ray_fcache_t* self = queue->fcache;
+
+  uint32_t hash = ray_str_hash(path);
+  ray_fcache_ent_t* ent = ray_fcache_find(self, path, hash);
+
+  if (ent) {
+    switch (ent->state) {
+      case RAY_FCACHE_READY: {
+        ray_fcache_lru_unlink(self, ent);
+        ray_fcache_lru_push(self, ent);
+        if (stat) *stat = ent->stat;
+        ent->refs++;
+        return ent->fd;
+      }
+      case RAY_FCACHE_MISSING: {
+        if (uv_now(queue->loop) < ent->expires) return ent->err;
+        int rc = ray_fcache_submit(self, ent);
+        return rc ? rc : UV__EAGAIN;
+      }
+      default: {
+        /* lookup already in flight */
+        return UV__EAGAIN;
+      }
+    }
+  }
+
+  ent = (ray_fcache_ent_t*)calloc(1, sizeof(ray_fcache_ent_t));
+  ent->path  = strdup(path);
+  ent->hash  = hash;
+  ent->fd    = -1;
+  ent->state = RAY_FCACHE_MISSING;
+  ent->cache = self;
+
+  ray_fcache_ent_t** slot = &self->paths[hash & (self->nbuckets - 1)];
+  ent->hnext = *slot;
+  *slot = ent;
+  ray_fcache_lru_push(self, ent);
+  self->nents++;
+
+  int rc = ray_fcache_submit(self, ent);
+  if (rc) {
+    ray_fcache_retire(self, ent);
+    return rc;
+  }
+
+  ray_fcache_evict(self);
+  return UV__EAGAIN;
+}
+
+int ray_fs_cache_close(ray_queue_t* queue, ray_file_t fd) {
+  ray_fcache_t* self = queue->fcache;
+  if (!self || fd < 0) return UV__EINVAL;
+
+  ray_fcache_ent_t* ent = self->fds[(uint32_t)fd & (self->nbuckets - 1)];
+  while (ent && ent->fd != fd) ent = ent->fnext;
+  if (!ent || ent->refs == 0) return UV__EINVAL;
+
+  if (--ent->refs == 0 && ent->state == RAY_FCACHE_STALE) {
+    ray_fcache_destroy(self, ent);
+  }
+  return 0;
+}
+
+/* Entries with an open in flight are orphaned, their job frees them. Stale
+   entries still referenced are only reachable by descriptor and are closed
+   along with the rest. */
+void ray_fs_cache_free(ray_fcache_t* self) {
+  ray_fcache_ent_t* ent = self->head;
+  size_t i;
+  while (ent) {
+    ray_fcache_ent_t* next = ent->next;
+    if (ent->state == RAY_FCACHE_PENDING) {
+      ray_fcache_unwatch(ent);
+      ent->cache = NULL;
+    }
+    else ray_fcache_destroy(self, ent);
+    ent = next;
+  }
+  for (i = 0; i < self->nbuckets; i++) {
+    while (self->fds[i]) ray_fcache_destroy(self, self->fds[i]);
+  }
+  self->queue->fcache = NULL;
+  free(self->paths);
+  free(self->fds);
+  free(self);
+}
+
+/* ========================================================================== */
+/* batched file system operations                                             */
+/* ========================================================================== */
+ray_fs_batch_t* ray_fs_batch_new(ray_queue_t* queue, size_t size) {
+  ray_fs_batch_t* self = (ray_fs_batch_t*)calloc(1, sizeof(ray_fs_batch_t));
+  if (!size) size = 16;
+  self->queue    = queue;
+  self->size     = size;
+  self->ops      = calloc(size, sizeof(ray_fs_result_t));
+  self->max_read = RAY_BATCH_MAX_READ;
+  return self;
+}
+
+int ray_fs_batch_add(ray_fs_batch_t* self, int op, const char* path) {
+  if (self->chunks) return UV__EBUSY;
+  if (self->nops == self->size) {
+    self->size *= 2;
+    self->ops = realloc(self->ops, self->size * sizeof(ray_fs_result_t));
+  }
+  ray_fs_result_t* res = &self->ops[self->nops];
+  memset(res, 0, sizeof(ray_fs_result_t));
+  res->op   = op;
+  res->path = ray_mem_strdup(self->queue, RAY_MEM_STRING, path);
+  if (!res->path) return UV__ENOMEM;
+  return (int)self->nops++;
+}
+
+void ray_fs_batch_read(ray_fs_batch_t* batch, ray_fs_result_t* res) {
+  struct stat st;
+  int fd = open(res->path, O_RDONLY);
+  if (fd < 0) {
+    res->status = -errno;
+    return;
+  }
+  if (fstat(fd, &st)) {
+    res->status = -errno;
+  }
+  else if ((size_t)st.st_size > batch->max_read) {
+    res->status = -EFBIG;
+  }
+  else {
+    ray_stat_init_sys(&res->stat, &st);
+    res->data = (char*)ray_mem_alloc(batch->queue, RAY_MEM_FS, st.st_size + 1);
+    if (!res->data) {
+      res->status = UV__ENOMEM;
+      close(fd);
+      return;
+    }
+    while (res->len < (size_t)st.st_size) {
+      ssize_t n = read(fd, res->data + res->len, st.st_size - res->len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+        res->status = -errno;
+        break;
+      }
+      if (n == 0) break;
+      res->len += n;
+    }
+    res->data[res->len] = '\0';
+  }
+  close(fd);
+}
+
+void ray_fs_batch_work_cb(uv_work_t* req) {
+  ray_fs_chunk_t* chunk = container_of(req, ray_fs_chunk_t, req);
+  ray_fs_batch_t* batch = chunk->batch;
+  struct stat st;
+  size_t i;
+
+  for (i = chunk->first; i < chunk->last; i++) {
+    ray_fs_result_t* res = &batch->ops[i];
+    switch (res->op) {
+      case RAY_BATCH_STAT:
+        if (stat(res->path, &st)) res->status = -errno;
+        else ray_stat_init_sys(&res->stat, &st);
+        break;
+      case RAY_BATCH_LSTAT:
+        if (lstat(res->path, &st)) res->status = -errno;
+        else ray_stat_init_sys(&res->stat, &st);
+        break;
+      case RAY_BATCH_UNLINK:
+        if (unlink(res->path)) res->status = -errno;
+        break;
+      case RAY_BATCH_READ:
+        ray_fs_batch_read(batch, res);
+        break;
+      default:
+        res->status = UV__EINVAL;
+    }
+  }
+}
+
+void ray_fs_batch_after_cb(uv_work_t* req, int status) {
+  ray_fs_chunk_t* chunk = container_of(req, ray_fs_chunk_t, req);
+  ray_fs_batch_t* batch = chunk->batch;
+
+  if (status) {
+    size_t i;
+    for (i = chunk->first; i < chunk->last; i++) batch->ops[i].status = status;
+  }
+
+  /* chunks complete on the loop thread, so no locking is needed here */
+  if (--batch->npending == 0) {
+    ray_evt_t evt = ray_evt_init(NULL, RAY_FS_BATCH, (int)batch->nops, batch);
+    ray_queue_post(batch->queue, &evt);
+  }
+}
+
+/* Splits the batch into jobs of `chunk` operations which run concurrently on
+   the threadpool. A single RAY_FS_BATCH event carrying the batch follows once
+   every job has finished, and ray_evt_done releases it. An error return means
+   nothing was queued and the batch is still the caller's. Once any job is
+   queued 0 is returned and the event always follows; operations that could
+   not be queued carry the error as their status. */
+int ray_fs_batch_submit(ray_fs_batch_t* self, size_t chunk) {
+  size_t i;
+  if (self->chunks) return UV__EBUSY;
+  if (!chunk) chunk = RAY_BATCH_CHUNK;
+
+  self->nchunks  = (self->nops + chunk - 1) / chunk;
+  if (self->nchunks == 0) self->nchunks = 1;
+  self->npending = self->nchunks;
+  self->chunks   = calloc(self->nchunks, sizeof(ray_fs_chunk_t));
+
+  for (i = 0; i < self->nchunks; i++) {
+    ray_fs_chunk_t* c = &self->chunks[i];
+    c->batch = self;
+    c->first = i * chunk;
+    c->last  = c->first + chunk;
+    if (c->last > self->nops) c->last = self->nops;
+
+    int rc = uv_queue_work(self->queue->loop, &c->req,
+      ray_fs_batch_work_cb, ray_fs_batch_after_cb);
+    if (rc && i == 0) {
+      free(self->chunks);
+      self->chunks = NULL;
+      return rc;
+    }
+    if (rc) {
+      /* the jobs already queued report for the rest through the event */
+      size_t j;
+      for (j = c->first; j < self->nops; j++) self->ops[j].status = rc;
+      self->npending -= self->nchunks - i;
+      return 0;
+    }
+  }
+  return 0;
+}
+
+void ray_fs_batch_free(ray_fs_batch_t* self) {
+  size_t i;
+  for (i = 0; i < self->nops; i++) {
+    ray_mem_free(self->ops[i].path);
+    ray_mem_free(self->ops[i].data);
+  }
+  free(self->ops);
+  if (self->chunks) free(self->chunks);
+  free(self);
+}
+
+/* ========================================================================== */
+/* memory mapped files                                                        */
+/* ========================================================================== */
+typedef struct ray_mmap_work_s {
+  ray_map_t map;    /* must be first, handed out as event data */
+  char*     path;
+  int       advice;
+  int       err;
+} ray_mmap_work_t;
+
+int ray_advice_flag(int advice) {
+#ifndef _WIN32
+  switch (advice) {
+    case RAY_ADVISE_SEQUENTIAL: return MADV_SEQUENTIAL;
+    case RAY_ADVISE_RANDOM:     return MADV_RANDOM;
+    case RAY_ADVISE_WILLNEED:   return MADV_WILLNEED;
+    case RAY_ADVISE_DONTNEED:   return MADV_DONTNEED;
+    default:                    return MADV_NORMAL;
+  }
+#else
+  return 0;
+#endif
+}
+
+int ray_madvise(void* base, size_t size, int advice) {
+#ifndef _WIN32
+  /* allow advising arbitrary slices of a mapping */
+  size_t    page = (size_t)sysconf(_SC_PAGESIZE);
+  uintptr_t addr = (uintptr_t)base & ~(page - 1);
+  size += (uintptr_t)base - addr;
+  if (madvise((void*)addr, size, ray_advice_flag(advice))) return -errno;
+  return 0;
+#else
+  return UV__ENOSYS;
+#endif
+}
+
+void ray_mmap_work_cb(uv_work_t* req) {
+  ray_mmap_work_t* work = (ray_mmap_work_t*)req->data;
+#ifndef _WIN32
+  struct stat st;
+  int fd = open(work->path, O_RDONLY);
+  if (fd < 0) {
+    work->err = -errno;
+    return;
+  }
+  if (fstat(fd, &st)) {
+    work->err = -errno;
+    close(fd);
+    return;
+  }
+  work->map.size = (size_t)st.st_size;
+  if (work->map.size > 0) {
+    void* base = mmap(NULL, work->map.size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+      work->err = -errno;
+    }
+    else {
+      work->map.base = base;
+      madvise(base, work->map.size, ray_advice_flag(work->advice));
+    }
+  }
+  /* the mapping keeps its own reference to the file */
+  close(fd);
+#else
+  work->err = UV__ENOSYS;
+#endif
+}
+
+void ray_mmap_after_cb(uv_work_t* req, int status) {
+  ray_mmap_work_t* work = (ray_mmap_work_t*)req->data;
+  ray_queue_t* queue = (ray_queue_t*)req->loop->data;
+  ray_evt_t evt;
+
+  free(work->path);
+  work->path = NULL;
+
+  if (status) work->err = status;
+  if (work->err) {
+    evt = ray_evt_init(NULL, RAY_ERROR, work->err, NULL);
+    free(work);
+  }
+  else {
+    evt = ray_evt_init(NULL, RAY_FS_MMAP, 0, &work->map);
+  }
+
+  ray_msg_done(container_of(req, ray_msg_t, u));
+  ray_queue_post(queue, &evt);
+}
+
+/* maps `path` read-only on a worker thread, RAY_FS_MMAP carries a ray_map_t
+   whose mapping stays valid after ray_evt_done until ray_fs_munmap */
+int ray_fs_mmap(ray_queue_t* queue, const char* path, int advice) {
+  ray_mmap_work_t* work = (ray_mmap_work_t*)calloc(1, sizeof(ray_mmap_work_t));
+  work->path   = strdup(path);
+  work->advice = advice;
+
+  uv_work_t* req = &(ray_msg_next(queue)->u.work);
+  req->data = work;
+  return uv_queue_work(queue->loop, req, ray_mmap_work_cb, ray_mmap_after_cb);
+}
+
+void ray_munmap_work_cb(uv_work_t* req) {
+  ray_mmap_work_t* work = (ray_mmap_work_t*)req->data;
+#ifndef _WIN32
+  if (work->map.size > 0 && munmap(work->map.base, work->map.size)) {
+    work->err = -errno;
+  }
+#else
+  work->err = UV__ENOSYS;
+#endif
+}
+
+void ray_munmap_after_cb(uv_work_t* req, int status) {
+  ray_mmap_work_t* work = (ray_mmap_work_t*)req->data;
+  ray_queue_t* queue = (ray_queue_t*)req->loop->data;
+  ray_evt_t evt;
+
+  if (status) work->err = status;
+  if (work->err) {
+    evt = ray_evt_init(NULL, RAY_ERROR, work->err, NULL);
+  }
+  else {
+    evt = ray_evt_init(NULL, RAY_FS_MUNMAP, 0, NULL);
+  }
+  free(work);
+
+  ray_msg_done(container_of(req, ray_msg_t, u));
+  ray_queue_post(queue, &evt);
+}
+
+/* unmapping multi-GB regions can stall, so it runs on the threadpool too */
+int ray_fs_munmap(ray_queue_t* queue, void* base, size_t size) {
+  ray_mmap_work_t* work = (ray_mmap_work_t*)calloc(1, sizeof(ray_mmap_work_t));
+  work->map.base = base;
+  work->map.size = size;
+
+  uv_work_t* req = &(ray_msg_next(queue)->u.work);
+  req->data = work;
+  return uv_queue_work(queue->loop, req, ray_munmap_work_cb, ray_munmap_after_cb);
+}
+
 int ray_cwd(char* buffer, size_t len) {
   uv_errno_t err = uv_cwd(buffer, len);
   return err;
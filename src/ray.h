@@ -9,6 +9,9 @@
 #include <sys/types.h>
 #ifndef _WIN32
 #include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
 #endif
 
 #ifdef WIN32
@@ -19,9 +22,16 @@
 # define INLINE inline
 #endif
 
+#ifdef RAY_USE_URING
+#include <sys/syscall.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
+#endif
+
 #undef RAY_DEBUG
 
 #include "libuv/include/uv.h"
+#include "ray_buf.h"
 
 #ifdef RAY_DEBUG
 #  define TRACE(fmt, ...) do { \
@@ -32,6 +42,11 @@
 #  define TRACE(fmt, ...) ((void)0)
 #endif /* RAY_DEBUG */
 
+/* records into the queue's trace ring when tracing is on, see ray_trace_enable */
+#define RAY_TRACE_ADD(q, kind, id, type, aux) do { \
+    if ((q)->tracing) ray_trace_add((q), (kind), (id), (type), (aux)); \
+  } while (0)
+
 
 /* default buffer size for read operations */
 #define RAY_BUF_SIZE 4096
@@ -39,6 +54,18 @@
 /* max path length */
 #define RAY_MAX_PATH 1024
 
+/* alignment of slab allocated handles */
+#define RAY_CACHE_LINE 64
+
+/* stream read buffer size */
+#define RAY_READ_SIZE 1024
+
+/* events ray_queue_next hands out before it lets the loop run again */
+#define RAY_LOCAL_BUDGET 64
+
+/* handles carved out of each slab chunk */
+#define RAY_SLAB_CHUNK 64
+
 #define container_of(ptr, type, member) \
   ((type*) ((char*)(ptr) - offsetof(type, member)))
 
@@ -81,9 +108,95 @@ typedef enum {
   RAY_FS_SYMLINK,
   RAY_FS_READLINK,
   RAY_FS_CHOWN,
-  RAY_FS_FCHOWN
+  RAY_FS_FCHOWN,
+  RAY_FS_MMAP,
+  RAY_FS_MUNMAP,
+  RAY_FS_BATCH,
+  RAY_MESSAGE
 } ray_type_t;
 
+/* operations accepted by ray_fs_batch_add */
+typedef enum {
+  RAY_BATCH_STAT,
+  RAY_BATCH_LSTAT,
+  RAY_BATCH_UNLINK,
+  RAY_BATCH_READ
+} ray_batch_op_t;
+
+/* how ray_fs_* calls are carried out, see ray_queue_set_fs_engine */
+typedef enum {
+  RAY_FS_ENGINE_THREADPOOL,
+  RAY_FS_ENGINE_URING
+} ray_fs_engine_t;
+
+/* access pattern hints for mapped files */
+typedef enum {
+  RAY_ADVISE_NORMAL,
+  RAY_ADVISE_SEQUENTIAL,
+  RAY_ADVISE_RANDOM,
+  RAY_ADVISE_WILLNEED,
+  RAY_ADVISE_DONTNEED
+} ray_advice_t;
+
+/* operations a fiber can park on, see ray_wait */
+typedef enum {
+  RAY_WAIT_READ,
+  RAY_WAIT_WRITE,
+  RAY_WAIT_ACCEPT,
+  RAY_WAIT_CLOSE,
+  RAY_WAIT_CONNECT,
+  RAY_WAIT_MAX
+} ray_wait_op_t;
+
+/* event lanes, in order of priority */
+typedef enum {
+  RAY_LANE_CONTROL,   /* timers, accepts and connects */
+  RAY_LANE_IO,        /* stream reads, writes, errors and closes */
+  RAY_LANE_FS,        /* file system, work and idle */
+  RAY_LANE_MAX
+} ray_lane_id_t;
+
+/* how ray_queue_take picks a lane, see ray_queue_set_lane_policy */
+typedef enum {
+  RAY_LANE_WRR,       /* control first, the others by weight */
+  RAY_LANE_STRICT     /* a lane only runs when those above it are empty */
+} ray_lane_policy_t;
+
+/* what a trace entry records */
+typedef enum {
+  RAY_TRACE_POST,
+  RAY_TRACE_TAKE,
+  RAY_TRACE_DONE,
+  RAY_TRACE_RUN_ENTER,  /* aux is the uv_run mode */
+  RAY_TRACE_RUN_EXIT,   /* aux is what uv_run returned */
+  RAY_TRACE_FS_SUBMIT,  /* aux is the op's sequence number, see ray_trace_op */
+  RAY_TRACE_FS_COMPLETE
+} ray_trace_kind_t;
+
+/* ray_listen flags */
+typedef enum {
+  RAY_ACCEPT_AUTO = 1,  /* accept into pooled handles, info is the client id */
+  RAY_ACCEPT_READ = 2   /* and start reading on them right away */
+} ray_accept_flag_t;
+
+/* handle state bits, kept above the ray_listen flags */
+#define RAY_HANDLE_THROTTLED 0x100
+#define RAY_HANDLE_MAILBOX   0x200
+#define RAY_HANDLE_CLOSING   0x400
+#define RAY_HANDLE_DEFERRED  0x800  /* a connection waits for memory */
+
+/* what the memory a queue accounts for is used for */
+typedef enum {
+  RAY_MEM_HANDLE,   /* handle slabs */
+  RAY_MEM_READ,     /* stream read buffers */
+  RAY_MEM_FS,       /* stat and readdir results, batch file contents */
+  RAY_MEM_STRING,   /* paths and link targets handed out with events */
+  RAY_MEM_BUFFER,   /* streaming reader and log buffers */
+  RAY_MEM_MAIL,     /* messages delivered and not yet done */
+  RAY_MEM_OTHER,
+  RAY_MEM_MAX
+} ray_mem_cat_t;
+
 union ray_handle_u {
   uv_handle_t     handle;
   uv_stream_t     stream;
@@ -116,49 +229,232 @@ union ray_msg_u {
 typedef uv_file  ray_file_t;
 
 typedef struct ray_evt_s   ray_evt_t;
+typedef struct ray_lane_s  ray_lane_t;
+typedef struct ray_trace_s ray_trace_t;
+typedef struct ray_trace_ent_s ray_trace_ent_t;
 typedef struct ray_msg_s   ray_msg_t;
 typedef struct ray_req_s   ray_req_t;
 typedef struct ray_queue_s ray_queue_t;
 typedef struct ray_handle_s ray_handle_t;
+typedef struct ray_slot_s  ray_slot_t;
+typedef struct ray_htable_s ray_htable_t;
+typedef struct ray_slab_s  ray_slab_t;
+typedef struct ray_waiter_s ray_waiter_t;
+typedef struct ray_waitq_s ray_waitq_t;
 
 typedef struct ray_timespec_s ray_timespec_t;
 
 typedef struct ray_dir_s   ray_dir_t;
 typedef struct ray_stat_s  ray_stat_t;
+typedef struct ray_map_s   ray_map_t;
+typedef struct ray_fs_batch_s  ray_fs_batch_t;
+typedef struct ray_fs_result_s ray_fs_result_t;
+typedef struct ray_fs_chunk_s  ray_fs_chunk_t;
+typedef struct ray_uring_s     ray_uring_t;
+typedef struct ray_fcache_s ray_fcache_t;
+typedef struct ray_fcache_ent_s ray_fcache_ent_t;
+typedef struct ray_iov_s   ray_iov_t;
+typedef struct ray_dns_s   ray_dns_t;
+typedef struct ray_dns_ent_s  ray_dns_ent_t;
+typedef struct ray_dns_wait_s ray_dns_wait_t;
+typedef struct ray_pool_s  ray_pool_t;
+typedef struct ray_pool_dest_s  ray_pool_dest_t;
+typedef struct ray_pool_conn_s  ray_pool_conn_t;
+typedef struct ray_pool_wait_s  ray_pool_wait_t;
+typedef struct ray_pool_stats_s ray_pool_stats_t;
+typedef struct ray_lease_s ray_lease_t;
+typedef struct ray_reader_s ray_reader_t;
+typedef struct ray_read_op_s ray_read_op_t;
+typedef struct ray_rbuf_s  ray_rbuf_t;
+typedef struct ray_log_s   ray_log_t;
+typedef struct ray_mail_s  ray_mail_t;
+typedef struct ray_link_s  ray_link_t;
+typedef struct ray_proxy_s ray_proxy_t;
+typedef struct ray_mem_s   ray_mem_t;
+
+/* a mailbox address, the owning queue's id above the mailbox handle's id */
+typedef uint64_t ray_addr_t;
  
 struct ray_evt_s {
   ray_type_t    type;
-  ray_handle_t* self;
+  uint32_t      id;
   int           info;
   void*         data;
 };
 
+/* Handle ids pack a slot index with the slot's generation, which is bumped
+   when the handle is freed. Id 0 is never issued and marks events without a
+   handle. Ids fit in 31 bits so they survive a round trip through an int.
+   Freed slots are reused oldest first, so a slot's generation only wraps
+   after every other free slot has been reused as often. */
+#define RAY_HANDLE_IDX_BITS 17
+#define RAY_HANDLE_IDX_MASK ((1u << RAY_HANDLE_IDX_BITS) - 1)
+#define RAY_HANDLE_GEN_MASK ((1u << 14) - 1)
+
+struct ray_slot_s {
+  ray_handle_t* handle;
+  uint32_t      gen;
+  uint32_t      next;   /* free list link */
+};
+
+struct ray_htable_s {
+  ray_slot_t*   slots;
+  uint32_t      size;
+  uint32_t      used;
+  uint32_t      free;   /* oldest freed slot, 0 if none */
+  uint32_t      tail;   /* newest freed slot */
+};
+
+/* handle size classes, so that a timer doesn't pay for a uv_process_t */
+typedef enum {
+  RAY_SLAB_SMALL,   /* timer, idle, prepare, check, async, poll, fs watchers */
+  RAY_SLAB_STREAM,  /* tcp, pipe */
+  RAY_SLAB_UDP,
+  RAY_SLAB_LARGE,   /* tty, process and anything else */
+  RAY_SLAB_MAX
+} ray_slab_class_t;
+
+struct ray_slab_s {
+  ray_queue_t*  queue;    /* chunks are charged to it as RAY_MEM_HANDLE */
+  size_t        size;
+  void*         free;
+  void**        chunks;
+  size_t        nchunks;
+  size_t        nused;
+};
+
+/* A parked fiber. Waiters come from a per-queue pool and are moved between
+   a handle's wait queue and the queue's ready queue by relinking, so waking
+   one is O(1) and never allocates. Fiber ids are the caller's, 0 is "none". */
+struct ray_waiter_s {
+  ray_waiter_t* next;
+  int           fid;
+};
+
+struct ray_waitq_s {
+  ray_waiter_t* head;
+  ray_waiter_t* tail;
+};
+
 struct ray_msg_s {
   union ray_msg_u u;
   ray_queue_t*    queue;
+  int             type;   /* the fs operation, for tracing */
+  uint32_t        tseq;   /* trace sequence number */
 };
 
-struct ray_queue_s {
-  size_t        nput_evts;
-  size_t        nget_evts;
-  size_t        size_evts;
+struct ray_trace_ent_s {
+  uint64_t      ts;       /* uv_hrtime */
+  uint32_t      id;       /* handle id */
+  int32_t       aux;
+  int16_t       type;
+  uint8_t       kind;
+};
+
+struct ray_trace_s {
+  ray_trace_ent_t* ents;
+  size_t           size;  /* power of two */
+  size_t           nput;
+  uint32_t         nops;  /* fs operations submitted */
+};
+
+/* one event ring per lane, events of one type always share a lane so that
+   per handle order holds within it */
+struct ray_lane_s {
+  size_t        nput;
+  size_t        nget;
+  size_t        size;
   ray_evt_t*    evts;
+  int           weight;
+  int           credit;
+};
+
+struct ray_queue_s {
+  ray_lane_t    lanes[RAY_LANE_MAX];
+  size_t        nevts;
+  int           lane_policy;
+
+  int           tracing;
+  ray_trace_t   trace;
 
   size_t        nput_msgs;
   size_t        nget_msgs;
   size_t        size_msgs;
   ray_msg_t*    msgs;
 
+  ray_htable_t  handles;
+  ray_slab_t    slabs[RAY_SLAB_MAX];
+
+  ray_slab_t    waiters;
+  ray_waitq_t   ready;
+  size_t        nready;
+
   uv_loop_t*    loop;
   uv_async_t    async;
   uv_timer_t    timer;
+
+  /* the thread running the queue, posts from it never need the async,
+     see ray_queue_wake */
+  unsigned long owner;
+  int           running;  /* inside uv_run */
+  uv_idle_t     kick;
+  uint32_t      nlocal;   /* events taken since the loop last ran */
+
+  /* reads per handle per loop turn, 0 for no limit */
+  uint32_t      read_budget;
+  uint64_t      turn;
+  uint64_t      nthrottled;
+  ray_handle_t* throttled;   /* parked, for the budget or for memory */
+  uv_prepare_t  prepare;
+
+  /* bytes in use by category, see ray_mem_alloc */
+  uint64_t      mem[RAY_MEM_MAX];
+  uint64_t      mem_used;
+  uint64_t      mem_soft;   /* reads pause and accepts wait past it */
+  uint64_t      mem_hard;   /* allocations fail past it */
+  uint64_t      nmem_denied;
+  int           mem_parked;
+  char          spill[RAY_READ_SIZE];
+
+  /* messages, see ray_mail_send */
+  uint32_t      qid;
+  ray_mail_t*   inbox;      /* pushed to by other threads, newest first */
+  ray_mail_t*   mail_head;  /* waiting for room in the event ring */
+  ray_mail_t*   mail_tail;
+  size_t        nmailboxes;
+
+  ray_fcache_t* fcache;
+  ray_dns_t*    dns;
+  ray_pool_t*   pool;
+  ray_uring_t*  uring;
 };
 
+/* `u` must stay last, handles are only allocated as large as their type */
 struct ray_handle_s {
-  union ray_handle_u u;
   ray_queue_t*       queue;
-  int                id;
+  uint32_t           id;
+  int                slab;
+  int                flags;
   void*              data;
+  ray_pool_conn_t*   pooled;
+  uint32_t           nstale;      /* queued reads to drop, see ray_pool_release */
+  ray_reader_t*      reader;
+  ray_log_t*         log;
+  ray_link_t*        link;
+  ray_proxy_t*       proxy;
+  uint64_t           read_turn;
+  uint32_t           nreads;      /* in read_turn */
+  uint32_t           nthrottled;
+  ray_handle_t*      throttle_next;
+  ray_waitq_t        waits[RAY_WAIT_MAX];
+  union ray_handle_u u;
+};
+
+/* precedes every block from ray_mem_alloc */
+struct ray_mem_s {
+  ray_queue_t* queue;
+  size_t       size;
+  int          cat;
 };
 
 struct ray_dir_s {
@@ -166,6 +462,17 @@ struct ray_dir_s {
   size_t nlen;
 };
 
+/* read-only file mapping, carried as data by RAY_FS_MMAP */
+struct ray_map_s {
+  void*  base;
+  size_t size;
+};
+
+struct ray_iov_s {
+  char*  base;
+  size_t len;
+};
+
 struct ray_timespec_s {
   long tv_sec;
   long tv_nsec;
@@ -185,37 +492,434 @@ struct ray_stat_s {
   ray_timespec_t ctim;
 };
 
+/* open file cache entry states */
+#define RAY_FCACHE_PENDING  0
+#define RAY_FCACHE_READY    1
+#define RAY_FCACHE_MISSING  2
+#define RAY_FCACHE_STALE    3
+
+struct ray_fcache_ent_s {
+  char*             path;
+  uint32_t          hash;
+  int               state;
+  ray_file_t        fd;
+  int               err;
+  int               refs;
+  int               changed;  /* the watch fired while the open ran */
+  uint64_t          expires;
+  ray_stat_t        stat;
+  ray_handle_t*     watch;
+  ray_fcache_t*     cache;
+  ray_fcache_ent_t* hnext;  /* path bucket chain */
+  ray_fcache_ent_t* fnext;  /* descriptor bucket chain */
+  ray_fcache_ent_t* prev;   /* lru list */
+  ray_fcache_ent_t* next;
+};
+
+struct ray_fcache_s {
+  ray_queue_t*       queue;
+  size_t             nents;
+  size_t             max_ents;
+  size_t             nbuckets;
+  ray_fcache_ent_t** paths;
+  ray_fcache_ent_t** fds;
+  ray_fcache_ent_t*  head;
+  ray_fcache_ent_t*  tail;
+  uint64_t           neg_ttl;
+};
+
+/* resolver cache entry states */
+#define RAY_DNS_PENDING  0
+#define RAY_DNS_READY    1
+#define RAY_DNS_FAILED   2
+
+#define RAY_DNS_BUCKETS   64
+#define RAY_DNS_MAX_ADDRS 8
+
+/* a connect waiting on a lookup, by id since the handle may go first */
+struct ray_dns_wait_s {
+  uint32_t        id;
+  int             port;
+  ray_dns_wait_t* next;
+};
+
+struct ray_dns_ent_s {
+  char*             host;
+  uint32_t          hash;
+  int               state;
+  int               err;
+  uint64_t          expires;
+  int               naddrs;
+  unsigned          next_addr;  /* connects rotate through the addresses */
+  struct sockaddr_storage addrs[RAY_DNS_MAX_ADDRS];
+  ray_dns_wait_t*   whead;
+  ray_dns_wait_t*   wtail;
+  ray_dns_ent_t*    hnext;
+  ray_dns_t*        dns;
+  uv_getaddrinfo_t  req;
+};
+
+struct ray_dns_s {
+  ray_queue_t*      queue;
+  uint64_t          ttl;
+  uint64_t          neg_ttl;
+  ray_dns_ent_t*    buckets[RAY_DNS_BUCKETS];
+};
+
+/* pooled connection states */
+#define RAY_POOL_CONNECTING  0
+#define RAY_POOL_BUSY        1
+#define RAY_POOL_IDLE        2
+
+#define RAY_POOL_BUCKETS 64
+
+/* carried as data by the RAY_CONNECT that answers a ray_pool_acquire */
+struct ray_lease_s {
+  int      ticket;
+  int      status;
+  uint64_t wait_ns;   /* from acquire to grant */
+};
+
+struct ray_pool_conn_s {
+  ray_handle_t*    handle;
+  ray_pool_dest_t* dest;
+  int              state;
+  int              ticket;      /* acquire served by the connect in flight */
+  uint64_t         since;       /* hrtime of that acquire */
+  uint64_t         idle_since;  /* loop time it was released */
+  ray_pool_conn_t* prev;        /* idle list */
+  ray_pool_conn_t* next;
+};
+
+struct ray_pool_wait_s {
+  int              ticket;
+  uint64_t         since;
+  ray_pool_wait_t* next;
+};
+
+struct ray_pool_dest_s {
+  ray_pool_t*      pool;
+  char*            host;
+  int              port;
+  uint32_t         hash;
+  int              nconns;      /* connecting, busy and idle */
+  ray_pool_conn_t* idle;        /* most recently released first */
+  ray_pool_conn_t* idle_tail;
+  ray_pool_wait_t* whead;
+  ray_pool_wait_t* wtail;
+  ray_pool_dest_t* hnext;
+};
+
+struct ray_pool_stats_s {
+  uint64_t acquires;
+  uint64_t reuses;      /* granted an idle connection */
+  uint64_t connects;
+  uint64_t waits;       /* queued behind the per destination cap */
+  uint64_t evictions;
+  uint64_t wait_ns;     /* total over all grants */
+  uint64_t max_wait_ns;
+};
+
+struct ray_pool_s {
+  ray_queue_t*      queue;
+  int               max_conns;  /* per destination */
+  uint64_t          idle_ttl;
+  int               next_ticket;
+  uv_timer_t        timer;
+  ray_pool_stats_t  stats;
+  ray_pool_dest_t*  buckets[RAY_POOL_BUCKETS];
+};
+
+/* streaming reader chunk bounds and reads kept in flight */
+#define RAY_READER_MIN_CHUNK (64 * 1024)
+#define RAY_READER_MAX_CHUNK (1024 * 1024)
+#define RAY_READER_DEPTH     2
+
+/* reader read states */
+#define RAY_READ_IDLE  0
+#define RAY_READ_BUSY  1
+#define RAY_READ_DONE  2
+
+/* Header of a reader buffer, the data of its RAY_FS_READ starts right after
+   it. Finishing the event hands the buffer back to the reader by id. */
+struct ray_rbuf_s {
+  ray_queue_t*  queue;
+  uint32_t      id;
+  size_t        size;
+  ray_rbuf_t*   next;   /* free list */
+};
+
+struct ray_read_op_s {
+  uv_fs_t       req;
+  ray_reader_t* reader;
+  ray_rbuf_t*   buf;
+  uint64_t      seq;    /* reads are delivered in the order issued */
+  uint32_t      tseq;   /* trace sequence number */
+  size_t        len;
+  ssize_t       result;
+  int           state;
+};
+
+struct ray_reader_s {
+  ray_handle_t* handle;
+  ray_file_t    file;
+  int64_t       ofs;    /* of the next read issued */
+  size_t        chunk;
+  int           depth;
+  int           nbusy;  /* reads in flight */
+  int           nheld;  /* delivered, not yet done */
+  int           paused;
+  int           eof;    /* nothing more to read or deliver */
+  int           closing;
+  uint64_t      nsubmit;
+  uint64_t      npost;
+  uint64_t      bytes;
+  ray_rbuf_t*   free;
+  ray_read_op_t ops[RAY_READER_DEPTH];
+};
+
+/* append log defaults, a group is flushed at this size or after the window */
+#define RAY_LOG_GROUP  (256 * 1024)
+#define RAY_LOG_WINDOW 2
+
+/* Records are copied into `buf` while the group before them is written and
+   synced from `wbuf`, the two swap when a flush starts. Sequence numbers
+   count records from 1. */
+struct ray_log_s {
+  ray_handle_t* handle;
+  ray_file_t    file;
+  int64_t       ofs;      /* where the next group goes */
+  char*         buf;
+  size_t        len;
+  size_t        size;
+  char*         wbuf;
+  size_t        wlen;
+  size_t        wsize;
+  uint64_t      seq;      /* last record appended */
+  uint64_t      wseq;     /* last record of the group in flight */
+  uint64_t      durable;
+  uint64_t      nsyncs;
+  size_t        group;
+  uint64_t      window;   /* ms */
+  int           flushing;
+  int           armed;
+  int           closing;
+  int           closed;   /* the timer is */
+  int           err;      /* of the last failed flush, sticky */
+  int           werr;     /* set by the flush job */
+  uv_work_t     work;
+  uv_timer_t    timer;
+};
+
+/* queues that can be addressed by id */
+#define RAY_MAX_QUEUES 256
+
+/* larger messages are refused, larger frames end a link */
+#define RAY_MAIL_MAX (16 * 1024 * 1024)
+
+/* A message. The sender fills `buf` and hands the mail over, it is
+   delivered as the data of a RAY_MESSAGE without being copied, with `buf`
+   rewound to the start and `len` bytes in it. */
+struct ray_mail_s {
+  ray_buf_t     buf;
+  size_t        len;
+  ray_addr_t    from;
+  uint32_t      to;
+  ray_mail_t*   next;
+  ray_queue_t*  queue;    /* charged to, once delivered */
+  size_t        charged;
+};
+
+/* Carries messages to another process over a pipe. Frames are a uleb128
+   payload length, the uint64 addresses of the receiver on the other side
+   (its queue 0 for the link's own) and of the sender on this side (0 for
+   none), then the payload. Frames sent while a write is in flight go out
+   together. */
+struct ray_link_s {
+  ray_handle_t* handle;
+  ray_buf_t     rbuf;   /* partial frames */
+  ray_buf_t     obuf;   /* waiting for the write in flight */
+  ray_buf_t     wbuf;   /* being written */
+  int           writing;
+  uv_write_t    req;
+  ray_proxy_t*  proxies;
+};
+
+/* Stands in for a mailbox on the other side of a link, so that remote
+   senders have an address here. Mail to it goes back over the link. */
+struct ray_proxy_s {
+  ray_handle_t* handle;
+  ray_link_t*   link;
+  ray_addr_t    remote;
+  ray_proxy_t*  next;
+};
+
+/* default number of batch operations run by one threadpool job */
+#define RAY_BATCH_CHUNK 256
+
+/* files larger than this fail a RAY_BATCH_READ with EFBIG */
+#define RAY_BATCH_MAX_READ 65536
+
+struct ray_fs_result_s {
+  int         op;
+  int         status;
+  char*       path;
+  ray_stat_t  stat;
+  char*       data;
+  size_t      len;
+};
+
+struct ray_fs_chunk_s {
+  uv_work_t       req;
+  ray_fs_batch_t* batch;
+  size_t          first;
+  size_t          last;
+};
+
+struct ray_fs_batch_s {
+  ray_queue_t*     queue;
+  size_t           nops;
+  size_t           size;
+  ray_fs_result_t* ops;
+  size_t           max_read;
+  size_t           nchunks;
+  size_t           npending;
+  ray_fs_chunk_t*  chunks;
+};
+
+#ifdef RAY_USE_URING
+/* submission queue depth of the io_uring fs engine */
+#define RAY_URING_ENTRIES 256
+
+struct ray_uring_s {
+  int                  fd;
+  ray_queue_t*         queue;
+  unsigned             features;
+
+  unsigned*            sq_head;
+  unsigned*            sq_tail;
+  unsigned*            sq_array;
+  unsigned             sq_mask;
+  unsigned             sq_entries;
+  struct io_uring_sqe* sqes;
+
+  unsigned*            cq_head;
+  unsigned*            cq_tail;
+  unsigned             cq_mask;
+  unsigned             cq_entries;
+  struct io_uring_cqe* cqes;
+
+  void*                sq_ring;
+  size_t               sq_ring_sz;
+  void*                cq_ring;
+  size_t               cq_ring_sz;
+  size_t               sqes_sz;
+
+  unsigned             nqueued;
+  unsigned             ninflight;
+
+  uv_poll_t            poll;
+  uv_prepare_t         prepare;
+};
+
+void ray_uring_free(ray_uring_t* self, int now);
+#endif
+
 ray_queue_t* ray_queue_new(size_t size);
 int ray_queue_init(ray_queue_t* self, size_t size);
 void ray_queue_free(ray_queue_t* self);
 
 int ray_evt_count(ray_queue_t* self);
+int ray_lane_of(int type);
+int ray_evt_lane(const ray_evt_t* evt);
+int ray_queue_set_lane_policy(ray_queue_t* self, int policy);
+int ray_queue_set_lane_weight(ray_queue_t* self, int lane, int weight);
 ray_evt_t ray_evt_init(ray_handle_t* o, ray_type_t t, int i, void* d);
 
-ray_handle_t* ray_handle_new(ray_queue_t* queue);
+ray_handle_t* ray_handle_new(ray_queue_t* queue, int type);
 void ray_handle_free(ray_handle_t* self);
+ray_handle_t* ray_handle_get(ray_queue_t* queue, uint32_t id);
+int ray_handle_reserve(ray_queue_t* queue, int type, size_t n);
+
+int ray_wait(ray_handle_t* self, int op, int fid);
+int ray_wait_pop(ray_handle_t* self, int op);
+int ray_waiting(ray_handle_t* self, int op);
+int ray_wake(ray_handle_t* self, int op);
+int ray_wake_all(ray_handle_t* self, int op);
+int ray_ready(ray_queue_t* queue, int fid);
+int ray_ready_next(ray_queue_t* queue);
+size_t ray_ready_count(ray_queue_t* queue);
 
 void ray_queue_post(ray_queue_t* self, ray_evt_t* evt);
+void ray_queue_post_local(ray_queue_t* self, ray_evt_t* evt);
+void ray_queue_defer(ray_queue_t* self, ray_handle_t* handle, int info, void* data);
+void ray_queue_done(ray_queue_t* self, ray_evt_t* evt);
 ray_evt_t* ray_queue_take(ray_queue_t* self);
 ray_evt_t* ray_queue_peek(ray_queue_t* self);
 ray_evt_t* ray_queue_next(ray_queue_t* self);
 
+const char* ray_type_name(int type);
+
+int ray_trace_enable(ray_queue_t* self, size_t size);
+void ray_trace_disable(ray_queue_t* self);
+void ray_trace_add(ray_queue_t* self, int kind, uint32_t id, int type, int32_t aux);
+uint32_t ray_trace_op(ray_queue_t* self);
+int ray_trace_dump(ray_queue_t* self, const char* path);
+
 int ray_last_error(ray_queue_t* self);
 const char* ray_strerror(int code);
 const char* ray_err_name(int code);
 
 int ray_queue_interrupt(ray_queue_t* queue);
+void ray_queue_wake(ray_queue_t* self);
 
 ray_handle_t* ray_tcp_new(ray_queue_t* queue);
 int ray_tcp_init(ray_handle_t* self);
 int ray_tcp_bind(ray_handle_t* self, const char* host, int port);
+int ray_tcp_connect(ray_handle_t* self, const char* host, int port);
+
+void ray_queue_set_dns_ttl(ray_queue_t* queue, uint64_t ttl, uint64_t neg_ttl);
+void ray_dns_free(ray_dns_t* dns);
+
+int ray_pool_config(ray_queue_t* queue, int max_conns, uint64_t idle_ttl);
+int ray_pool_acquire(ray_queue_t* queue, const char* host, int port);
+int ray_pool_release(ray_handle_t* handle);
+int ray_pool_discard(ray_handle_t* handle);
+void ray_pool_stats(ray_queue_t* queue, ray_pool_stats_t* stats);
+void ray_pool_close(ray_queue_t* queue);
+void ray_pool_free(ray_pool_t* pool, int now);
+void ray_pool_connected(ray_pool_conn_t* conn, int status);
+void ray_pool_forget(ray_pool_conn_t* conn);
+void ray_pool_drop(ray_pool_conn_t* conn);
 
 int ray_read_start(ray_handle_t* self);
 int ray_read_stop(ray_handle_t* self);
+void ray_queue_set_read_budget(ray_queue_t* self, uint32_t budget);
+uint64_t ray_queue_get_throttled(ray_queue_t* self);
+uint32_t ray_handle_get_throttled(ray_handle_t* self);
+void ray_throttle(ray_handle_t* self);
+void ray_unthrottle(ray_handle_t* self);
+void ray_park(ray_handle_t* self);
+void ray_queue_resume(ray_queue_t* self);
+
+/* memory accounting */
+void* ray_mem_alloc(ray_queue_t* queue, int cat, size_t size);
+void* ray_mem_realloc(ray_queue_t* queue, int cat, void* ptr, size_t size);
+char* ray_mem_strdup(ray_queue_t* queue, int cat, const char* str);
+void ray_mem_free(void* ptr);
+int ray_mem_charge(ray_queue_t* queue, int cat, size_t size, int strict);
+void ray_mem_uncharge(ray_queue_t* queue, int cat, size_t size);
+void* ray_mem_take(ray_queue_t* queue, int cat, size_t size, int strict);
+void ray_mem_pause(ray_handle_t* self);
+int ray_mem_tight(ray_queue_t* queue);
+void ray_queue_set_mem_limits(ray_queue_t* self, uint64_t soft, uint64_t hard);
+uint64_t ray_queue_mem_used(ray_queue_t* self, int cat);
+uint64_t ray_queue_mem_denied(ray_queue_t* self);
 
 int ray_write(ray_handle_t* self, const char* str, size_t len);
+int ray_writev(ray_handle_t* self, const ray_iov_t* iov, int cnt);
 
-int ray_listen(ray_handle_t* self, int backlog);
+int ray_listen(ray_handle_t* self, int backlog, int flags);
 int ray_accept(ray_handle_t* server, ray_handle_t* client);
 
 void ray_close(ray_handle_t* self);
@@ -224,10 +928,74 @@ ray_handle_t* ray_timer_new(ray_queue_t* queue);
 int ray_timer_start(ray_handle_t* self, int64_t timeo, int64_t repeat);
 int ray_timer_stop(ray_handle_t* self);
 
+ray_handle_t* ray_idle_new(ray_queue_t* queue);
+int ray_idle_start(ray_handle_t* self);
+int ray_idle_stop(ray_handle_t* self);
+
 ray_evt_t* ray_queue_next(ray_queue_t* self);
 void ray_evt_done(ray_evt_t* evt);
 
-int  ray_handle_get_id(ray_handle_t* self);
-void ray_handle_set_id(ray_handle_t* self, int id);
-
-
+uint32_t ray_handle_get_id(ray_handle_t* self);
+void* ray_handle_get_data(ray_handle_t* self);
+void  ray_handle_set_data(ray_handle_t* self, void* data);
+
+int ray_fs_mmap(ray_queue_t* queue, const char* path, int advice);
+int ray_fs_munmap(ray_queue_t* queue, void* base, size_t size);
+int ray_madvise(void* base, size_t size, int advice);
+
+int ray_fs_cache_init(ray_queue_t* queue, size_t max_ents, int64_t neg_ttl);
+int ray_fs_cache_open(ray_queue_t* queue, const char* path, ray_stat_t* stat);
+int ray_fs_cache_close(ray_queue_t* queue, ray_file_t fd);
+void ray_fs_cache_free(ray_fcache_t* cache);
+
+ray_fs_batch_t* ray_fs_batch_new(ray_queue_t* queue, size_t size);
+int ray_fs_batch_add(ray_fs_batch_t* self, int op, const char* path);
+int ray_fs_batch_submit(ray_fs_batch_t* self, size_t chunk);
+void ray_fs_batch_free(ray_fs_batch_t* self);
+
+ray_handle_t* ray_reader_new(ray_queue_t* queue, ray_file_t file, int64_t ofs, int depth);
+int ray_reader_pause(ray_handle_t* self);
+int ray_reader_resume(ray_handle_t* self);
+size_t ray_reader_chunk(ray_handle_t* self);
+void ray_reader_close(ray_reader_t* reader);
+void ray_reader_free(ray_reader_t* reader);
+void ray_reader_release(void* data);
+
+ray_handle_t* ray_log_new(ray_queue_t* queue, ray_file_t file, int64_t ofs);
+int ray_log_config(ray_handle_t* self, size_t group, uint64_t window);
+int ray_log_append(ray_handle_t* self, const void* data, size_t len, uint64_t* seq);
+int ray_log_flush(ray_handle_t* self);
+uint64_t ray_log_durable(ray_handle_t* self);
+uint64_t ray_log_syncs(ray_handle_t* self);
+void ray_log_close(ray_log_t* log);
+void ray_log_free(ray_log_t* log);
+
+uint32_t ray_queue_get_id(ray_queue_t* self);
+ray_queue_t* ray_queue_get(uint32_t qid);
+ray_queue_t* ray_queue_acquire(uint32_t qid);
+void ray_queue_release(uint32_t qid);
+ray_handle_t* ray_mailbox_new(ray_queue_t* queue);
+ray_addr_t ray_mailbox_addr(ray_handle_t* self);
+void ray_mailbox_close(ray_handle_t* self);
+ray_mail_t* ray_mail_new(size_t size);
+void ray_mail_free(ray_mail_t* mail);
+int ray_mail_send(ray_handle_t* from, ray_addr_t to, ray_mail_t* mail);
+void ray_mail_drain(ray_queue_t* queue);
+void ray_mail_pump(ray_queue_t* queue);
+ray_handle_t* ray_link_new(ray_queue_t* queue, ray_file_t fd);
+int ray_link_send(ray_handle_t* self, ray_handle_t* from, ray_addr_t to, ray_mail_t* mail);
+ray_addr_t ray_link_proxy(ray_link_t* self, ray_addr_t remote);
+int ray_mail_route(ray_addr_t to, ray_mail_t* mail);
+void ray_link_free(ray_link_t* link);
+
+int ray_queue_set_fs_engine(ray_queue_t* queue, int engine);
+int ray_queue_get_fs_engine(ray_queue_t* queue);
+
+int ray_fs_open(ray_queue_t* queue, const char *path, const char* how, int mode);
+int ray_fs_close(ray_queue_t* queue, ray_file_t file);
+int ray_fs_read(ray_queue_t* queue, ray_file_t fh, char* buf, size_t len, int64_t ofs);
+int ray_fs_write(ray_queue_t* queue, ray_file_t file, void* buf, size_t len, int64_t ofs);
+int ray_fs_stat(ray_queue_t* queue, const char* path);
+int ray_fs_fstat(ray_queue_t* queue, ray_file_t file);
+int ray_fs_fsync(ray_queue_t* queue, ray_file_t file);
+int ray_fs_fdatasync(ray_queue_t* queue, ray_file_t file);
@@ -28,7 +28,7 @@ void ray_buf_need(ray_buf_t* buf, size_t len) {
   }
   ptrdiff_t head = buf->head - buf->base;
   ptrdiff_t need = head + len;
-  while (size < need) size *= 2;
+  while (size < (size_t)need) size *= 2;
   if (size > buf->size) {
     buf->base = (uint8_t*)realloc(buf->base, size);
     buf->size = size;
@@ -56,23 +56,23 @@ void ray_buf_put(ray_buf_t* buf, uint8_t val) {
 }
 void ray_buf_put_uint16(ray_buf_t* buf, uint16_t val) {
   ray_buf_need(buf, 2);
-  const uint8_t* p = (const uint8_t*)buf->head;
+  uint8_t* p = buf->head;
   *p++ = val;
   *p++ = val >> 8;
-  buf->head = (uint8_t*)p;
+  buf->head = p;
 }
 void ray_buf_put_uint32(ray_buf_t* buf, uint32_t val) {
   ray_buf_need(buf, 4);
-  const uint8_t* p = (const uint8_t*)buf->head;
+  uint8_t* p = buf->head;
   *p++ = val;
   *p++ = val >> 8;
   *p++ = val >> 16;
   *p++ = val >> 24;
-  buf->head = (uint8_t*)p;
+  buf->head = p;
 }
 void ray_buf_put_uint64(ray_buf_t* buf, uint64_t val) {
   ray_buf_need(buf, 8);
-  const uint8_t* p = (const uint8_t*)buf->head;
+  uint8_t* p = buf->head;
   *p++ = val;
   *p++ = val >> 8;
   *p++ = val >> 16;
@@ -81,10 +81,11 @@ void ray_buf_put_uint64(ray_buf_t* buf, uint64_t val) {
   *p++ = val >> 40;
   *p++ = val >> 48;
   *p++ = val >> 56;
-  buf->head = (uint8_t*)p;
+  buf->head = p;
 }
 void ray_buf_put_double(ray_buf_t* buf, double val) {
-  uint64_t u64 = *(uint64_t*)(void*)&val;
+  uint64_t u64;
+  memcpy(&u64, &val, sizeof(u64));
   ray_buf_put_uint64(buf, u64);
 }
 
@@ -94,7 +95,7 @@ void ray_buf_write(ray_buf_t* buf, uint8_t* data, size_t len) {
   buf->head += len;
 }
 
-void ray_buf_write_uleb128(ray_buf_t* buf, uint32_t val) {
+void ray_buf_put_uleb128(ray_buf_t* buf, uint32_t val) {
   ray_buf_need(buf, 5);
   size_t   n = 0;
   uint8_t* p = buf->head;
@@ -106,7 +107,7 @@ void ray_buf_write_uleb128(ray_buf_t* buf, uint32_t val) {
 }
 
 void ray_buf_set_offset(ray_buf_t* buf, ssize_t ofs) {
-  if (ofs > buf->size) ofs = -1;
+  if (ofs > (ssize_t)buf->size) ofs = -1;
   if (ofs < 0) {
     buf->head = buf->base + buf->size + ofs;
   }
@@ -122,35 +123,35 @@ uint8_t ray_buf_get(ray_buf_t* buf) {
   return *(buf->head++);
 }
 uint16_t ray_buf_get_uint16(ray_buf_t* buf) {
-  const uint8_t* p = (const uint8_t)buf->head;
+  const uint8_t* p = (const uint8_t*)buf->head;
   uint16_t v = *p++;
-  v += (*p++) << 8;
+  v |= (uint16_t)(*p++ << 8);
   buf->head = (uint8_t*)p;
   return v;
 }
 uint32_t ray_buf_get_uint32(ray_buf_t* buf) {
-  const uint8_t* p = (const uint8_t)buf->head;
+  const uint8_t* p = (const uint8_t*)buf->head;
   uint32_t v = *p++;
-  v += (*p++) << 8;
-  v += (*p++) << 16;
-  v += (*p++) << 24;
+  v |= (uint32_t)(*p++) << 8;
+  v |= (uint32_t)(*p++) << 16;
+  v |= (uint32_t)(*p++) << 24;
   buf->head = (uint8_t*)p;
   return v;
-
 }
 uint64_t ray_buf_get_uint64(ray_buf_t* buf) {
-  const uint8_t* p = (const uint8_t)buf->head;
+  const uint8_t* p = (const uint8_t*)buf->head;
   uint64_t v = *p++;
-  v += (*p++) << 8;
-  v += (*p++) << 16;
-  v += (*p++) << 24;
-  v += (*p++) << 32;
-  v += (*p++) << 40;
-  v += (*p++) << 48;
-  v += (*p++) << 56;
+  v |= (uint64_t)(*p++) << 8;
+  v |= (uint64_t)(*p++) << 16;
+  v |= (uint64_t)(*p++) << 24;
+  v |= (uint64_t)(*p++) << 32;
+  v |= (uint64_t)(*p++) << 40;
+  v |= (uint64_t)(*p++) << 48;
+  v |= (uint64_t)(*p++) << 56;
   buf->head = (uint8_t*)p;
   return v;
 }
+/* reads at most the 5 bytes a uint32_t takes, even if the input says more */
 uint32_t ray_buf_get_uleb128(ray_buf_t* buf) {
   const uint8_t* p = (const uint8_t*)buf->head;
   uint32_t v = *p++;
@@ -158,22 +159,24 @@ uint32_t ray_buf_get_uleb128(ray_buf_t* buf) {
     int sh = 0;
     v &= 0x7f;
     do {
-     v |= ((*p & 0x7f) << (sh += 7));
-    } while (*p++ >= 0x80);
+      v |= (uint32_t)(*p & 0x7f) << (sh += 7);
+    } while (*p++ >= 0x80 && sh < 28);
   }
   buf->head = (uint8_t*)p;
   return v;
 }
 double ray_buf_get_double(ray_buf_t* buf) {
   uint64_t u64 = ray_buf_get_uint64(buf);
-  return *(double*)(void*)&u64;
+  double val;
+  memcpy(&val, &u64, sizeof(val));
+  return val;
 }
 
 uint8_t ray_buf_peek(ray_buf_t* buf) {
   return *buf->head;
 }
 uint8_t* ray_buf_read(ray_buf_t* buf, size_t len) {
-  assert(buf_get_offset(buf) + len <= buf->size);
+  assert(ray_buf_get_offset(buf) + len <= buf->size);
   uint8_t* p = buf->head;
   buf->head += len;
   return p;
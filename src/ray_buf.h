@@ -1,9 +1,13 @@
 #ifndef _RAY_BUF_H_
 #define _RAY_BUF_H_
 
-#include "ray_common.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
 
-typedef struct ray_buf_t {
+typedef struct ray_buf_s {
   size_t   size;
   uint8_t* head;
   uint8_t* base;
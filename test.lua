@@ -15,23 +15,30 @@ lib.ray_idle_start(idle)
 --]]
 
 Sched = { }
-Sched.IDGEN = 0
 Sched.ALIVE = { }
 Sched.QUEUE = lib.ray_queue_new(1024)
-Sched.COROS = { }
+-- fibers are known to the C side by id, parking and waking them on
+-- handles is O(1) and doesn't touch these tables
+Sched.FIBERS = { }
+Sched.FIDS = { }
+Sched.FREE = { }
+Sched.NFIDS = 0
 
 function Sched:run()
+   local queue = self.QUEUE
    while true do
-      while #self.COROS > 0 do
-         local coro = table.remove(self.COROS, 1)
-         assert(coroutine.resume(coro))
+      local fid = lib.ray_ready_next(queue)
+      while fid ~= 0 do
+         self:resume(fid)
+         fid = lib.ray_ready_next(queue)
       end
-      local evt = lib.ray_queue_next(self.QUEUE)
+      local evt = lib.ray_queue_next(queue)
       if evt == nil then
          -- no more pending events
          break
       end
-      local oid = lib.ray_handle_get_id(evt.self)
+      -- events for freed handles never get here
+      local oid = evt.id
       if oid > 0 then
          local obj = self.ALIVE[oid]
          if obj then
@@ -40,23 +47,58 @@ function Sched:run()
       else
          error("not found")
       end
-      lib.ray_evt_done(evt)
+      lib.ray_queue_done(queue, evt)
    end
 end
-function Sched:genid()
-   self.IDGEN = self.IDGEN + 1
-   return self.IDGEN
-end
 function Sched:add(obj)
-   local oid = self:genid()
    if type(obj) == 'thread' then
-      self.COROS[#self.COROS + 1] = obj
+      lib.ray_ready(self.QUEUE, self:spawn(obj))
    elseif obj.cdata then
-      lib.ray_handle_set_id(obj.cdata, oid)
+      local oid = lib.ray_handle_get_id(obj.cdata)
       obj.id = oid
       self.ALIVE[oid] = obj
+      return oid
+   end
+end
+function Sched:spawn(coro)
+   local free = self.FREE
+   local fid = free[#free]
+   if fid then
+      free[#free] = nil
+   else
+      self.NFIDS = self.NFIDS + 1
+      fid = self.NFIDS
    end
-   return oid
+   self.FIBERS[fid] = coro
+   self.FIDS[coro] = fid
+   return fid
+end
+function Sched:resume(fid, ...)
+   local coro = self.FIBERS[fid]
+   assert(coroutine.resume(coro, ...))
+   if coroutine.status(coro) == 'dead' then
+      self.FIBERS[fid] = nil
+      self.FIDS[coro] = nil
+      self.FREE[#self.FREE + 1] = fid
+   end
+end
+-- park the running fiber on `op` of a handle until it is woken
+function Sched:wait(cdata, op)
+   local fid = self.FIDS[coroutine.running()]
+   assert(lib.ray_wait(cdata, op, fid) == 0)
+   return coroutine.yield()
+end
+-- resume the oldest fiber parked on `op`, false if there was none
+function Sched:wake(cdata, op, ...)
+   local fid = lib.ray_wait_pop(cdata, op)
+   if fid == 0 then
+      return false
+   end
+   self:resume(fid, ...)
+   return true
+end
+function Sched:wake_all(cdata, op, ...)
+   while self:wake(cdata, op, ...) do end
 end
 
 Fiber = { }
@@ -82,18 +124,12 @@ TCPSocket.__index = TCPSocket
 function TCPSocket.new(class)
    local self = { }
    self.cdata = lib.ray_tcp_new(Sched.QUEUE)
-   self.read_queue = { }
-   self.write_queue = { }
-   self.close_queue = { }
    Sched:add(self)
    return setmetatable(self, class)
 end
 function TCPSocket.new_from_cdata(class, cdata)
    local self = setmetatable({
       cdata = cdata;
-      read_queue = { };
-      write_queue = { };
-      close_queue = { };
    }, class)
    Sched:add(self)
    return self
@@ -103,41 +139,23 @@ function TCPSocket:react(evt)
    if evt.type == 'RAY_ERROR' then
       print("RAY_ERROR")
       if self.cdata then
-         while #self.read_queue > 0 do
-            local coro = table.remove(self.read_queue, 1)
-            coroutine.resume(coro, nil, evt.info)
-         end
-         while #self.write_queue > 0 do
-            local coro = table.remove(self.write_queue, 1)
-            coroutine.resume(coro, nil, evt.info)
-         end
-         while #self.close_queue > 0 do
-            local coro = table.remove(self.close_queue, 1)
-            coroutine.resume(coro, nil, evt.info)
-         end
+         Sched:wake_all(self.cdata, lib.RAY_WAIT_READ, nil, evt.info)
+         Sched:wake_all(self.cdata, lib.RAY_WAIT_WRITE, nil, evt.info)
+         Sched:wake_all(self.cdata, lib.RAY_WAIT_CLOSE, nil, evt.info)
       end
       lib.ray_close(self.cdata)
    elseif evt.type == 'RAY_READ' then
       print("RAY_READ")
       local data = evt.data
-      if #self.read_queue > 0 then
-         local coro = table.remove(self.read_queue, 1)
-         coroutine.resume(coro, ffi.string(data, evt.info))
-      else
+      if not Sched:wake(self.cdata, lib.RAY_WAIT_READ, ffi.string(data, evt.info)) then
          lib.ray_read_stop(self.cdata)
       end
    elseif evt.type == 'RAY_WRITE' then
       print("RAY_WRITE")
-      if #self.write_queue > 0 then
-         local coro = table.remove(self.write_queue, 1)
-         coroutine.resume(coro)
-      end
+      Sched:wake(self.cdata, lib.RAY_WAIT_WRITE)
    elseif evt.type == 'RAY_CLOSE' then
       print("RAY_CLOSE", self.cdata)
-      if #self.close_queue > 0 then
-         local coro = table.remove(self.close_queue, 1)
-         coroutine.resume(coro)
-      end
+      Sched:wake(self.cdata, lib.RAY_WAIT_CLOSE)
       if self.cdata then
          print("FREE AGENT")
          lib.ray_handle_free(self.cdata)
@@ -148,21 +166,15 @@ function TCPSocket:react(evt)
 end
 function TCPSocket:read(size)
    print("TCPSocket:read - ", self.cdata)
-   local curr = coroutine.running()
    lib.ray_read_start(self.cdata, size or 1024)
-   self.read_queue[#self.read_queue + 1] = curr
-   return coroutine.yield()
+   return Sched:wait(self.cdata, lib.RAY_WAIT_READ)
 end
 function TCPSocket:write(data)
-   local curr = coroutine.running()
-   self.write_queue[#self.write_queue + 1] = curr
    lib.ray_write(self.cdata, data, #data)
-   return coroutine.yield()
+   return Sched:wait(self.cdata, lib.RAY_WAIT_WRITE)
 end
 function TCPSocket:close()
-   local curr = coroutine.running()
-   self.close_queue[#self.close_queue + 1] = curr
-   return coroutine.yield()
+   return Sched:wait(self.cdata, lib.RAY_WAIT_CLOSE)
 end
 
 Actor = { }
@@ -187,8 +199,6 @@ TCPServer.__index = TCPServer
 function TCPServer.new(class)
    local self = setmetatable({
       cdata = lib.ray_tcp_new(Sched.QUEUE);
-      accept_queue = { },
-      close_queue  = { },
    }, class)
    Sched:add(self)
    return self
@@ -197,35 +207,444 @@ function TCPServer:react(evt)
    if evt.type == 'RAY_ERROR' then
       local mesg = evt.info
    elseif evt.type == 'RAY_CONNECTION' then
-      local cdata = lib.ray_tcp_new(Sched.QUEUE)
-      lib.ray_accept(self.cdata, cdata)
-      local sock = TCPSocket:new_from_cdata(cdata)
-      if #self.accept_queue > 0 then
-         local coro = table.remove(self.accept_queue, 1)
-         coroutine.resume(coro, sock)
+      -- auto-accepted, info is the client's handle id
+      if evt.info <= 0 then
+         return
       end
+      local cdata = lib.ray_handle_get(Sched.QUEUE, evt.info)
+      local sock = TCPSocket:new_from_cdata(cdata)
+      Sched:wake(self.cdata, lib.RAY_WAIT_ACCEPT, sock)
    elseif evt.type == 'RAY_CLOSE' then
-      if #self.close_queue > 0 then
-         local coro = table.remove(self.close_queue, 1)
-         coroutine.resume(coro)
-      end
+      Sched:wake(self.cdata, lib.RAY_WAIT_CLOSE)
    end
 end
 function TCPServer:bind(host, port)
    return lib.ray_tcp_bind(self.cdata, host, port)   
 end
 function TCPServer:listen(backlog)
-   return lib.ray_listen(self.cdata, backlog)
+   return lib.ray_listen(self.cdata, backlog, lib.RAY_ACCEPT_AUTO)
 end
 function TCPServer:accept()
-   local curr, main = coroutine.running()
-   if main then
-      local client = lib.ray_tcp_new(Sched.QUEUE)
-      lib.ray_accept(self.cdata, client)
-   else
-      self.accept_queue[#self.accept_queue + 1] = curr
-      return coroutine.yield()
+   return Sched:wait(self.cdata, lib.RAY_WAIT_ACCEPT)
+end
+
+-- self checks, each on a queue of its own, run before the server starts
+ffi.cdef[[
+int socketpair(int domain, int type, int protocol, int sv[2]);
+int open(const char* path, int flags, ...);
+int close(int fd);
+]]
+local C = ffi.C
+
+local Check = { }
+-- the next event, which has to be of type `etype`
+function Check.expect(queue, etype)
+   local evt = lib.ray_queue_next(queue)
+   assert(evt ~= nil, "no event, expected "..etype)
+   assert(evt.type == etype, "got "..tostring(evt.type)..", expected "..etype)
+   return evt
+end
+function Check.mail(text)
+   local mail = lib.ray_mail_new(#text)
+   lib.ray_buf_write(mail.buf, ffi.cast('uint8_t*', text), #text)
+   return mail
+end
+function Check.text(evt)
+   local mail = ffi.cast('ray_mail_t*', evt.data)
+   return ffi.string(mail.buf.base, mail.len), mail.from
+end
+-- closes the handles and frees each on its RAY_CLOSE, anything else that
+-- is still queued for them is dropped
+function Check.close(queue, ...)
+   local open = { }
+   for _, cdata in ipairs({ ... }) do
+      open[lib.ray_handle_get_id(cdata)] = true
+      lib.ray_close(cdata)
+   end
+   while next(open) do
+      local evt = lib.ray_queue_next(queue)
+      assert(evt ~= nil, "handles left open")
+      if evt.type == 'RAY_CLOSE' and open[evt.id] then
+         open[evt.id] = nil
+         lib.ray_handle_free(lib.ray_handle_get(queue, evt.id))
+      end
+      lib.ray_queue_done(queue, evt)
+   end
+end
+function Check.file(path, data)
+   local out = assert(io.open(path, 'wb'))
+   out:write(data)
+   out:close()
+end
+
+-- freed slots are reused oldest first and under a new generation, events
+-- still queued for a freed handle are dropped
+function Check.handles()
+   local queue = lib.ray_queue_new(64)
+   local function slot(id) return bit.band(id, 0x1ffff) end
+
+   local a = lib.ray_handle_new(queue, 0)
+   local b = lib.ray_handle_new(queue, 0)
+   local ida, idb = lib.ray_handle_get_id(a), lib.ray_handle_get_id(b)
+   lib.ray_queue_defer(queue, a, 1, nil)
+   lib.ray_handle_free(a)
+   lib.ray_handle_free(b)
+   assert(lib.ray_handle_get(queue, ida) == nil)
+
+   local c = lib.ray_handle_new(queue, 0)
+   local idc = lib.ray_handle_get_id(c)
+   assert(slot(idc) == slot(ida) and idc ~= ida)
+   -- a single busy slot goes through far more than 2047 generations
+   for i = 1, 5000 do
+      lib.ray_handle_free(c)
+      c = lib.ray_handle_new(queue, 0)
+      local id = lib.ray_handle_get_id(c)
+      assert(id ~= ida and id ~= idb and id ~= 0)
+   end
+
+   lib.ray_queue_defer(queue, nil, 2, nil)
+   local evt = Check.expect(queue, 'RAY_CUSTOM')
+   assert(evt.id == 0 and evt.info == 2)
+   lib.ray_queue_done(queue, evt)
+
+   lib.ray_handle_free(c)
+   lib.ray_queue_free(queue)
+end
+
+-- a mailbox round trip on one thread, the reply goes to the sender
+function Check.mailbox()
+   local queue = lib.ray_queue_new(64)
+   local a = lib.ray_mailbox_new(queue)
+   local b = lib.ray_mailbox_new(queue)
+
+   assert(lib.ray_mail_send(a, lib.ray_mailbox_addr(b), Check.mail('PING')) == 0)
+   local evt = Check.expect(queue, 'RAY_MESSAGE')
+   assert(evt.id == lib.ray_handle_get_id(b))
+   local text, from = Check.text(evt)
+   assert(text == 'PING' and from == lib.ray_mailbox_addr(a))
+   assert(lib.ray_queue_mem_used(queue, lib.RAY_MEM_MAIL) > 0)
+   assert(lib.ray_mail_send(b, from, Check.mail('PONG')) == 0)
+   lib.ray_queue_done(queue, evt)
+
+   evt = Check.expect(queue, 'RAY_MESSAGE')
+   assert(evt.id == lib.ray_handle_get_id(a))
+   assert(Check.text(evt) == 'PONG')
+   lib.ray_queue_done(queue, evt)
+   assert(lib.ray_queue_mem_used(queue, lib.RAY_MEM_MAIL) == 0)
+
+   local big = Check.mail(string.rep('x', 16 * 1024 * 1024 + 1))
+   assert(lib.ray_mail_send(a, lib.ray_mailbox_addr(b), big) ~= 0)
+
+   Check.close(queue, a, b)
+   lib.ray_queue_free(queue)
+end
+
+-- frames of all sizes cross a socketpair in order, and a reply to one of
+-- them finds its way back over the link
+function Check.link()
+   local queue = lib.ray_queue_new(256)
+   local fds = ffi.new('int[2]')
+   assert(C.socketpair(1 --[[AF_UNIX]], 1 --[[SOCK_STREAM]], 0, fds) == 0)
+   local near = lib.ray_link_new(queue, fds[0])
+   local far  = lib.ray_link_new(queue, fds[1])
+   local a = lib.ray_mailbox_new(queue)
+   local b = lib.ray_mailbox_new(queue)
+
+   local sizes = { 0, 1, 127, 128, 4096, 100000, 3 }
+   for i, size in ipairs(sizes) do
+      local text = string.rep(string.char(64 + i), size)
+      assert(lib.ray_link_send(near, a, lib.ray_mailbox_addr(b), Check.mail(text)) == 0)
    end
+   local from
+   for i, size in ipairs(sizes) do
+      local evt = Check.expect(queue, 'RAY_MESSAGE')
+      assert(evt.id == lib.ray_handle_get_id(b))
+      local text
+      text, from = Check.text(evt)
+      assert(text == string.rep(string.char(64 + i), size), "frame "..i)
+      lib.ray_queue_done(queue, evt)
+   end
+
+   -- `from` is the far side's stand-in for `a`
+   assert(from ~= 0 and from ~= lib.ray_mailbox_addr(a))
+   assert(lib.ray_mail_send(b, from, Check.mail('REPLY')) == 0)
+   local evt = Check.expect(queue, 'RAY_MESSAGE')
+   assert(evt.id == lib.ray_handle_get_id(a))
+   assert(Check.text(evt) == 'REPLY')
+   lib.ray_queue_done(queue, evt)
+
+   Check.close(queue, near, far, a, b)
+   lib.ray_queue_free(queue)
+end
+
+-- a file comes back whole and in order, then ends with an empty read
+function Check.reader()
+   local path = os.tmpname()
+   local data = { }
+   for i = 1, 20000 do data[i] = string.format('%09d\n', i) end
+   data = table.concat(data)
+   Check.file(path, data)
+
+   local queue = lib.ray_queue_new(64)
+   local fd = C.open(path, 0 --[[O_RDONLY]])
+   assert(fd >= 0)
+   local reader = lib.ray_reader_new(queue, fd, 0, 0)
+   local got = { }
+   while true do
+      local evt = Check.expect(queue, 'RAY_FS_READ')
+      local n = evt.info
+      if n > 0 then got[#got + 1] = ffi.string(evt.data, n) end
+      lib.ray_queue_done(queue, evt)
+      if n == 0 then break end
+   end
+   assert(table.concat(got) == data)
+
+   Check.close(queue, reader)
+   C.close(fd)
+   lib.ray_queue_free(queue)
+   os.remove(path)
+end
+
+-- records get increasing sequence numbers and are all durable after the
+-- sync that follows a flush
+function Check.log()
+   local path = os.tmpname()
+   local queue = lib.ray_queue_new(64)
+   -- os.tmpname leaves the file created and empty
+   local fd = C.open(path, 2 --[[O_RDWR]])
+   assert(fd >= 0)
+   local log = lib.ray_log_new(queue, fd, 0)
+   local seq = ffi.new('uint64_t[1]')
+   for i, rec in ipairs({ 'one\n', 'two\n', 'three\n' }) do
+      assert(lib.ray_log_append(log, rec, #rec, seq) == 0)
+      assert(seq[0] == i)
+   end
+   assert(lib.ray_log_flush(log) == 0)
+   local evt = Check.expect(queue, 'RAY_FS_FDATASYNC')
+   lib.ray_queue_done(queue, evt)
+   assert(lib.ray_log_durable(log) == 3)
+
+   Check.close(queue, log)
+   C.close(fd)
+   lib.ray_queue_free(queue)
+   local input = assert(io.open(path, 'rb'))
+   assert(input:read('*a') == 'one\ntwo\nthree\n')
+   input:close()
+   os.remove(path)
+end
+
+-- past the hard limit a reader gets no buffer and ends with an error, the
+-- refusal is counted and nothing stays charged
+function Check.limits()
+   local path = os.tmpname()
+   Check.file(path, string.rep('x', 4096))
+
+   local queue = lib.ray_queue_new(64)
+   -- handle slots are charged too, get them in before the limit is set
+   local box = lib.ray_mailbox_new(queue)
+   lib.ray_queue_set_mem_limits(queue, 0, lib.ray_queue_mem_used(queue, lib.RAY_MEM_MAX) + 1024)
+   local fd = C.open(path, 0 --[[O_RDONLY]])
+   assert(fd >= 0)
+   local reader = lib.ray_reader_new(queue, fd, 0, 0)
+   local evt = Check.expect(queue, 'RAY_FS_ERROR')
+   assert(evt.info < 0)
+   lib.ray_queue_done(queue, evt)
+   assert(lib.ray_queue_mem_denied(queue) >= 1)
+   assert(lib.ray_queue_mem_used(queue, lib.RAY_MEM_BUFFER) == 0)
+
+   -- so is mail, which past the limit is dropped as it arrives
+   local denied = lib.ray_queue_mem_denied(queue)
+   local mail = Check.mail(string.rep('m', 4096))
+   assert(lib.ray_mail_send(box, lib.ray_mailbox_addr(box), mail) == 0)
+   assert(lib.ray_queue_mem_denied(queue) == denied + 1)
+   assert(lib.ray_queue_mem_used(queue, lib.RAY_MEM_MAIL) == 0)
+
+   lib.ray_queue_set_mem_limits(queue, 0, 0)
+   Check.close(queue, reader, box)
+   C.close(fd)
+   lib.ray_queue_free(queue)
+   os.remove(path)
+end
+
+-- a miss opens in the background and the next lookup hits, a missing file
+-- is remembered, and a change to the file drops its entry
+function Check.fcache()
+   local EAGAIN, ENOENT = -11, -2
+   local path = os.tmpname()
+   Check.file(path, 'hello')
+   local queue = lib.ray_queue_new(64)
+   assert(lib.ray_fs_cache_init(queue, 16, 60000) == 0)
+   local stat = ffi.new('ray_stat_t')
+
+   assert(lib.ray_fs_cache_open(queue, path, stat) == EAGAIN)
+   local evt = Check.expect(queue, 'RAY_FS_OPEN')
+   assert(evt.info >= 0 and ffi.string(evt.data) == path)
+   lib.ray_queue_done(queue, evt)
+   local fd = lib.ray_fs_cache_open(queue, path, stat)
+   assert(fd >= 0 and stat.size == 5)
+
+   local none = path..'.none'
+   assert(lib.ray_fs_cache_open(queue, none, nil) == EAGAIN)
+   evt = Check.expect(queue, 'RAY_ERROR')
+   assert(evt.info == ENOENT)
+   lib.ray_queue_done(queue, evt)
+   assert(lib.ray_fs_cache_open(queue, none, nil) == ENOENT)
+
+   -- the descriptor handed out stays good until it is given back
+   Check.file(path, 'changed')
+   local timer = lib.ray_timer_new(queue)
+   lib.ray_timer_start(timer, 100, 0)
+   lib.ray_queue_done(queue, Check.expect(queue, 'RAY_TIMER'))
+   assert(lib.ray_fs_cache_open(queue, path, stat) == EAGAIN)
+   assert(lib.ray_fs_cache_close(queue, fd) == 0)
+   lib.ray_queue_done(queue, Check.expect(queue, 'RAY_FS_OPEN'))
+   fd = lib.ray_fs_cache_open(queue, path, stat)
+   assert(fd >= 0 and stat.size == 7)
+   assert(lib.ray_fs_cache_close(queue, fd) == 0)
+
+   Check.close(queue, timer)
+   lib.ray_queue_free(queue)
+   os.remove(path)
+end
+
+-- with one connection per destination a second acquire waits for the
+-- release of the first, an idle connection is reused, and freeing the pool
+-- cancels the acquire still waiting but leaves the lease with its holder
+function Check.pool()
+   local ECANCELED = -125
+   local queue = lib.ray_queue_new(64)
+   local server = lib.ray_tcp_new(queue)
+   assert(lib.ray_tcp_bind(server, '127.0.0.1', 18081) == 0)
+   assert(lib.ray_listen(server, 8, lib.RAY_ACCEPT_AUTO) == 0)
+   assert(lib.ray_pool_config(queue, 1, 60000) == 0)
+
+   local accepted = { }
+   -- the RAY_CONNECT answering `ticket`, accepts on the way are kept
+   local function lease(ticket)
+      while true do
+         local evt = lib.ray_queue_next(queue)
+         assert(evt ~= nil, "no answer for ticket "..ticket)
+         if evt.type == 'RAY_CONNECTION' then
+            accepted[#accepted + 1] = lib.ray_handle_get(queue, evt.info)
+            lib.ray_queue_done(queue, evt)
+         else
+            assert(evt.type == 'RAY_CONNECT')
+            local l = ffi.cast('ray_lease_t*', evt.data)
+            assert(l.ticket == ticket)
+            local id, status = evt.id, l.status
+            lib.ray_queue_done(queue, evt)
+            return id, status
+         end
+      end
+   end
+
+   local t1 = lib.ray_pool_acquire(queue, '127.0.0.1', 18081)
+   local t2 = lib.ray_pool_acquire(queue, '127.0.0.1', 18081)
+   assert(t1 > 0 and t2 > t1)
+   local id, status = lease(t1)
+   assert(status == 0 and id ~= 0)
+   local conn = lib.ray_handle_get(queue, id)
+
+   -- handed straight to the waiting acquire
+   assert(lib.ray_pool_release(conn) == 0)
+   assert((lease(t2)) == id)
+   -- kept idle and granted again without a connect
+   assert(lib.ray_pool_release(conn) == 0)
+   local t3 = lib.ray_pool_acquire(queue, '127.0.0.1', 18081)
+   assert((lease(t3)) == id)
+
+   local stats = ffi.new('ray_pool_stats_t')
+   lib.ray_pool_stats(queue, stats)
+   assert(stats.acquires == 3 and stats.connects == 1)
+   assert(stats.waits == 1 and stats.reuses == 1)
+
+   local t4 = lib.ray_pool_acquire(queue, '127.0.0.1', 18081)
+   lib.ray_pool_close(queue)
+   id, status = lease(t4)
+   assert(id == 0 and status == ECANCELED)
+   assert(lib.ray_handle_get(queue, lib.ray_handle_get_id(conn)) == conn)
+   assert(lib.ray_pool_release(conn) ~= 0)
+
+   Check.close(queue, conn, server, unpack(accepted))
+   lib.ray_queue_free(queue)
+end
+
+-- one job per operation, those that fail carry their own status and don't
+-- hold up the others or the event
+function Check.batch()
+   local ENOENT = -2
+   local path = os.tmpname()
+   Check.file(path, 'contents')
+   local none = path..'.none'
+   local queue = lib.ray_queue_new(64)
+   local batch = lib.ray_fs_batch_new(queue, 2)
+   local ops = {
+      { lib.RAY_BATCH_STAT, path }, { lib.RAY_BATCH_STAT, none },
+      { lib.RAY_BATCH_READ, path }, { lib.RAY_BATCH_READ, none },
+      { lib.RAY_BATCH_UNLINK, none },
+   }
+   for i, op in ipairs(ops) do
+      assert(lib.ray_fs_batch_add(batch, op[1], op[2]) == i - 1)
+   end
+   assert(lib.ray_fs_batch_submit(batch, 1) == 0)
+   assert(lib.ray_fs_batch_submit(batch, 1) ~= 0)
+
+   local evt = Check.expect(queue, 'RAY_FS_BATCH')
+   assert(evt.info == #ops)
+   local res = ffi.cast('ray_fs_batch_t*', evt.data).ops
+   assert(res[0].status == 0 and res[0].stat.size == 8)
+   assert(res[1].status == ENOENT)
+   assert(res[2].status == 0 and ffi.string(res[2].data, res[2].len) == 'contents')
+   assert(res[3].status == ENOENT and res[3].data == nil)
+   assert(res[4].status == ENOENT)
+   lib.ray_queue_done(queue, evt)
+
+   lib.ray_queue_free(queue)
+   os.remove(path)
+end
+
+-- control events go first under either policy, strict priority drains io
+-- before fs, and weighted rounds interleave them by their weights
+function Check.lanes()
+   local queue = lib.ray_queue_new(64)
+   local function post(etype, info)
+      lib.ray_queue_post(queue, lib.ray_evt_init(nil, etype, info, nil))
+   end
+   local function drain()
+      local got = { }
+      local evt = lib.ray_queue_take(queue)
+      while evt ~= nil do
+         got[#got + 1] = evt.info
+         lib.ray_queue_done(queue, evt)
+         evt = lib.ray_queue_take(queue)
+      end
+      return table.concat(got, ' ')
+   end
+
+   assert(lib.ray_queue_set_lane_policy(queue, lib.RAY_LANE_STRICT) == 0)
+   post(lib.RAY_FS_CUSTOM, 1)
+   post(lib.RAY_CUSTOM, 2)
+   post(lib.RAY_TIMER, 3)
+   post(lib.RAY_CUSTOM, 4)
+   post(lib.RAY_FS_CUSTOM, 5)
+   post(lib.RAY_TIMER, 6)
+   assert(drain() == '3 6 2 4 1 5')
+
+   assert(lib.ray_queue_set_lane_policy(queue, lib.RAY_LANE_WRR) == 0)
+   assert(lib.ray_queue_set_lane_weight(queue, lib.RAY_LANE_IO, 2) == 0)
+   assert(lib.ray_queue_set_lane_weight(queue, lib.RAY_LANE_FS, 1) == 0)
+   for i = 1, 6 do post(lib.RAY_CUSTOM, i) end
+   for i = 7, 9 do post(lib.RAY_FS_CUSTOM, i) end
+   post(lib.RAY_TIMER, 0)
+   assert(drain() == '0 1 2 7 3 4 8 5 6 9')
+
+   assert(lib.ray_queue_set_lane_policy(queue, 99) ~= 0)
+   lib.ray_queue_free(queue)
+end
+
+for _, name in ipairs({ 'handles', 'mailbox', 'link', 'reader', 'log', 'limits', 'fcache', 'pool', 'batch', 'lanes' }) do
+   Check[name]()
+   print("check "..name..": ok")
 end
 
 local str = "Hello"
@@ -0,0 +1,132 @@
+/* Encode and decode throughput of the ray_buf codec, per variant and value
+   distribution. Each case runs a few times and the best run is reported. */
+#include <stdio.h>
+#include <time.h>
+
+#include "ray_buf.h"
+
+#define NVALS  (1 << 20)
+#define NRUNS  5
+
+typedef enum {
+  DIST_SMALL,    /* below 128, a single uleb128 byte */
+  DIST_LOG,      /* uniform bit length, the usual shape of lengths and ids */
+  DIST_UNIFORM,  /* uniform over the type's range */
+  DIST_MAX
+} dist_t;
+
+static const char* dist_names[DIST_MAX] = { "small", "log", "uniform" };
+
+static uint64_t vals[NVALS];
+static volatile uint64_t sink;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void) {
+  uint64_t x = rng_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return rng_state = x;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* `bits` wide values, doubles get theirs from integers unless uniform */
+static void fill(dist_t dist, int bits, int is_double) {
+  uint64_t mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+  size_t i;
+  for (i = 0; i < NVALS; i++) {
+    uint64_t v = rng();
+    switch (dist) {
+      case DIST_SMALL:
+        v &= 0x7f;
+        break;
+      case DIST_LOG: {
+        int len = (int)(rng() % (bits + 1));
+        v = len == 0 ? 0 : (v & (len == 64 ? ~0ULL : (1ULL << len) - 1));
+        break;
+      }
+      default:
+        v &= mask;
+    }
+    if (is_double && dist != DIST_UNIFORM) {
+      double d = (double)v;
+      memcpy(&v, &d, sizeof(v));
+    }
+    vals[i] = v;
+  }
+}
+
+static void report(const char* name, dist_t dist, const char* dir,
+                   double secs, size_t bytes) {
+  printf("%-8s %-8s %-6s %10.1f MB/s %14.0f values/s\n", name,
+         dist_names[dist], dir, bytes / secs / 1e6, NVALS / secs);
+}
+
+#define BENCH(NAME, BITS, IS_DOUBLE, PUT, GET, FROM, TO) \
+static void bench_##NAME(void) { \
+  ray_buf_t buf; \
+  int d, r; \
+  size_t i; \
+  ray_buf_init(&buf, NULL, NVALS * 8); \
+  for (d = 0; d < DIST_MAX; d++) { \
+    double enc = 1e9, dec = 1e9; \
+    size_t bytes = 0; \
+    uint64_t sum = 0; \
+    fill((dist_t)d, BITS, IS_DOUBLE); \
+    for (r = 0; r < NRUNS; r++) { \
+      double t = now(); \
+      ray_buf_set_offset(&buf, 0); \
+      for (i = 0; i < NVALS; i++) PUT(&buf, FROM(vals[i])); \
+      t = now() - t; \
+      if (t < enc) enc = t; \
+      bytes = ray_buf_get_offset(&buf); \
+      t = now(); \
+      ray_buf_set_offset(&buf, 0); \
+      for (i = 0; i < NVALS; i++) sum += TO(GET(&buf)); \
+      t = now() - t; \
+      if (t < dec) dec = t; \
+    } \
+    sink = sum; \
+    report(#NAME, (dist_t)d, "encode", enc, bytes); \
+    report(#NAME, (dist_t)d, "decode", dec, bytes); \
+  } \
+  free(buf.base); \
+}
+
+/* integers are narrowed by the call */
+#define AS_INT(v) (v)
+
+static double as_double(uint64_t v) {
+  double d;
+  memcpy(&d, &v, sizeof(d));
+  return d;
+}
+static uint64_t from_double(double d) {
+  uint64_t v;
+  memcpy(&v, &d, sizeof(v));
+  return v;
+}
+
+BENCH(uint8,   8,  0, ray_buf_put,         ray_buf_get,         AS_INT,    AS_INT)
+BENCH(uint16,  16, 0, ray_buf_put_uint16,  ray_buf_get_uint16,  AS_INT,    AS_INT)
+BENCH(uint32,  32, 0, ray_buf_put_uint32,  ray_buf_get_uint32,  AS_INT,    AS_INT)
+BENCH(uint64,  64, 0, ray_buf_put_uint64,  ray_buf_get_uint64,  AS_INT,    AS_INT)
+BENCH(double,  64, 1, ray_buf_put_double,  ray_buf_get_double,  as_double, from_double)
+BENCH(uleb128, 32, 0, ray_buf_put_uleb128, ray_buf_get_uleb128, AS_INT,    AS_INT)
+
+int main(void) {
+  printf("%d values per run, best of %d\n", NVALS, NRUNS);
+  bench_uint8();
+  bench_uint16();
+  bench_uint32();
+  bench_uint64();
+  bench_double();
+  bench_uleb128();
+  return 0;
+}
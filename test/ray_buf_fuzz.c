@@ -0,0 +1,177 @@
+/* Round-trip fuzzing of the ray_buf codec. The input is a script of
+   (variant, value bytes) pairs: every value is encoded, then the buffer is
+   rewound and decoded again, and must come back unchanged and take exactly
+   the bytes it was encoded into. The raw input is also decoded as uleb128,
+   which must never read past 5 bytes per value.
+
+   Built with -DRAY_LIBFUZZER this is a libFuzzer target, otherwise main()
+   runs the files given as arguments, or random inputs when there are none. */
+#include <stdio.h>
+#include <assert.h>
+
+#include "ray_buf.h"
+
+typedef enum {
+  OP_UINT8,
+  OP_UINT16,
+  OP_UINT32,
+  OP_UINT64,
+  OP_DOUBLE,
+  OP_ULEB128,
+  OP_WRITE,
+  OP_MAX
+} op_t;
+
+#define MAX_OPS 4096
+
+static const int op_sizes[OP_MAX] = { 1, 2, 4, 8, 8, 0, 0 };
+
+static size_t uleb128_size(uint32_t v) {
+  size_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static void check_uleb128(const uint8_t* data, size_t size) {
+  ray_buf_t buf;
+  size_t pos = 0;
+  /* padded so that a value running off the end is still terminated */
+  ray_buf_init(&buf, NULL, size + 5);
+  memcpy(buf.base, data, size);
+  memset(buf.base + size, 0, 5);
+  while (pos < size) {
+    ray_buf_get_uleb128(&buf);
+    size_t used = ray_buf_get_offset(&buf) - pos;
+    assert(used >= 1 && used <= 5);
+    pos += used;
+  }
+  free(buf.base);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  ray_buf_t buf;
+  op_t     ops[MAX_OPS];
+  uint64_t vals[MAX_OPS];
+  size_t   ends[MAX_OPS];
+  size_t   nops = 0, pos = 0, i;
+
+  check_uleb128(data, size);
+
+  ray_buf_init(&buf, NULL, 0);
+  while (pos < size && nops < MAX_OPS) {
+    op_t op = (op_t)(data[pos++] % OP_MAX);
+    uint64_t v = 0;
+    size_t n = op == OP_ULEB128 ? 4 : op == OP_WRITE ? 1 : (size_t)op_sizes[op];
+    for (i = 0; i < n && pos < size; i++) v |= (uint64_t)data[pos++] << (8 * i);
+
+    switch (op) {
+      case OP_UINT8:   ray_buf_put(&buf, (uint8_t)v); break;
+      case OP_UINT16:  ray_buf_put_uint16(&buf, (uint16_t)v); break;
+      case OP_UINT32:  ray_buf_put_uint32(&buf, (uint32_t)v); break;
+      case OP_UINT64:  ray_buf_put_uint64(&buf, v); break;
+      case OP_DOUBLE: {
+        double d;
+        memcpy(&d, &v, sizeof(d));
+        ray_buf_put_double(&buf, d);
+        break;
+      }
+      case OP_ULEB128: ray_buf_put_uleb128(&buf, (uint32_t)v); break;
+      case OP_WRITE: {
+        /* the next `v` input bytes, as many as there are */
+        if (v > size - pos) v = size - pos;
+        ray_buf_write(&buf, (uint8_t*)data + pos, v);
+        vals[nops] = pos;
+        pos += v;
+        break;
+      }
+      default: break;
+    }
+    ops[nops] = op;
+    if (op != OP_WRITE) vals[nops] = v;
+    ends[nops++] = ray_buf_get_offset(&buf);
+  }
+
+  ray_buf_set_offset(&buf, 0);
+  for (i = 0; i < nops; i++) {
+    size_t start = ray_buf_get_offset(&buf);
+    uint64_t v = vals[i];
+    switch (ops[i]) {
+      case OP_UINT8:   assert(ray_buf_get(&buf) == (uint8_t)v); break;
+      case OP_UINT16:  assert(ray_buf_get_uint16(&buf) == (uint16_t)v); break;
+      case OP_UINT32:  assert(ray_buf_get_uint32(&buf) == (uint32_t)v); break;
+      case OP_UINT64:  assert(ray_buf_get_uint64(&buf) == v); break;
+      case OP_DOUBLE: {
+        /* compared by bits, NaN != NaN */
+        double d = ray_buf_get_double(&buf);
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        assert(bits == v);
+        break;
+      }
+      case OP_ULEB128:
+        assert(ray_buf_get_uleb128(&buf) == (uint32_t)v);
+        assert(ray_buf_get_offset(&buf) - start == uleb128_size((uint32_t)v));
+        break;
+      case OP_WRITE: {
+        size_t len = ends[i] - start;
+        assert(memcmp(ray_buf_read(&buf, len), data + v, len) == 0);
+        break;
+      }
+      default: break;
+    }
+    assert(ray_buf_get_offset(&buf) == ends[i]);
+  }
+  free(buf.base);
+  return 0;
+}
+
+#ifndef RAY_LIBFUZZER
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t rng(void) {
+  uint64_t x = rng_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return rng_state = x;
+}
+
+static int run_file(const char* path) {
+  FILE* fp = fopen(path, "rb");
+  uint8_t* data;
+  long size;
+  if (!fp) {
+    perror(path);
+    return 1;
+  }
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  data = (uint8_t*)malloc(size ? size : 1);
+  if (fread(data, 1, size, fp) != (size_t)size) size = 0;
+  fclose(fp);
+  LLVMFuzzerTestOneInput(data, size);
+  free(data);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  uint8_t data[1024];
+  int i, n = 100000;
+  if (argc > 1) {
+    int rc = 0;
+    for (i = 1; i < argc; i++) rc |= run_file(argv[i]);
+    return rc;
+  }
+  for (i = 0; i < n; i++) {
+    size_t size = rng() % sizeof(data), j;
+    for (j = 0; j < size; j++) data[j] = (uint8_t)rng();
+    LLVMFuzzerTestOneInput(data, size);
+  }
+  printf("ray_buf_fuzz: %d inputs round-tripped\n", n);
+  return 0;
+}
+#endif